@@ -0,0 +1,130 @@
+// Copyright (c) 2024 José Francisco Castro <me@fran.cc>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <string.h>
+
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#include "aggregates.h"
+#include "application.h"
+#include "enums.h"
+#include "measurements.h"
+#include "now.h"
+
+aggregate_series_t aggregates[AGGREGATES_NUM_MAX];
+static uint8_t aggregates_count = 0;         // series in the open window, 0 when no window is open
+int64_t aggregates_start = 0;           // esp_timer time of the first sample of the window
+aggregate_series_t aggregates_closed[AGGREGATES_NUM_MAX];     // of the last window, emitted as the ring has room
+uint8_t aggregates_closed_count = 0;
+uint8_t aggregates_closed_next = 0;
+static uint8_t aggregates_unfolded = 0;     // rows of the pass left in the ring as the table was full
+
+void aggregates_init()
+{
+    aggregates_count = 0;
+    aggregates_closed_count = 0;
+    aggregates_closed_next = 0;
+}
+
+void aggregates_resolve(int64_t shift)
+{
+    for(uint8_t i = 0; i < aggregates_count; i++)
+        if(aggregates[i].row.timestamp <= NOW_VALID_MIN_MS)
+            aggregates[i].row.timestamp += shift;
+    for(uint8_t i = aggregates_closed_next; i < aggregates_closed_count; i++)
+        if(aggregates_closed[i].row.timestamp <= NOW_VALID_MIN_MS)
+            aggregates_closed[i].row.timestamp += shift;
+}
+
+static bool same_series(measurement_t *a, measurement_t *b)
+{
+    return a->node == b->node && a->resource == b->resource && a->bus == b->bus && a->multiplexer == b->multiplexer &&
+           a->channel == b->channel && a->address == b->address && a->part == b->part &&
+           a->parameter == b->parameter && a->metric == b->metric;
+}
+
+// a pass fills at most the ring, so only series appearing mid-window can find the table full,
+// their rows are kept in the ring as they are
+static bool fold(measurement_t *row)
+{
+    uint8_t i;
+    if(row->aggregate != AGGREGATE_NONE)
+        return false;
+    for(i = 0; i < aggregates_count && !same_series(&aggregates[i].row, row); i++);
+    if(i == AGGREGATES_NUM_MAX) {
+        aggregates_unfolded++;
+        return false;
+    }
+    if(i == aggregates_count) {
+        aggregates[i].min = row->value;
+        aggregates[i].max = row->value;
+        aggregates[i].sum = 0;
+        aggregates[i].count = 0;
+        aggregates_count++;
+    }
+    aggregates[i].row = *row;
+    aggregates[i].min = row->value < aggregates[i].min ? row->value : aggregates[i].min;
+    aggregates[i].max = row->value > aggregates[i].max ? row->value : aggregates[i].max;
+    aggregates[i].sum += row->value;
+    aggregates[i].count++;
+    return true;
+}
+
+static bool emit(aggregate_series_t *series, aggregate_t aggregate, float value)
+{
+    measurement_t row = series->row;
+    row.aggregate = aggregate;
+    row.value = value;
+    if(aggregate == AGGREGATE_COUNT)
+        row.unit = UNIT_NONE;
+    return measurements_append_row(&row);
+}
+
+// Folds every sample of the ring into the open window and drops it from the ring, unless the window
+// has no room left for its series. A window that closes hands its series over to be emitted as min,
+// max, mean, last and count rows, as many as fit in the ring on each pass. Returns whether rows were emitted.
+bool aggregates_update()
+{
+    int64_t now = esp_timer_get_time();
+    uint32_t period = application_period ? application_period : application.sampling_period;
+    int room;
+    int emitted = 0;
+
+    if(!aggregates_count)
+        aggregates_start = now;
+    aggregates_unfolded = 0;
+    measurements_compact(fold);
+    if(aggregates_unfolded)
+        ESP_LOGE(__func__, "%u rows left unaggregated, more than %u series in the window", aggregates_unfolded, AGGREGATES_NUM_MAX);
+
+    // closes on the pass nearest to the end of the window, or later while the last one is still being emitted
+    if(aggregates_count && aggregates_closed_next == aggregates_closed_count &&
+       now - aggregates_start + period * 500000LL >= application.aggregation_window * 1000000LL) {
+        memcpy(aggregates_closed, aggregates, aggregates_count * sizeof(aggregate_series_t));
+        aggregates_closed_count = aggregates_count;
+        aggregates_closed_next = 0;
+        aggregates_count = 0;
+        ESP_LOGI(__func__, "closed window of %u series", aggregates_closed_count);
+    }
+
+    // Emitted rows must not overwrite unsent ones. Windows only run on nodes that do not sleep, which upload
+    // on every pass, so the older rows of a queued ring were handed to the backends already and may give way,
+    // except for the ones this pass left unaggregated.
+    if(application.queue)
+        room = MEASUREMENTS_NUM_MAX - aggregates_unfolded;
+    else
+        room = MEASUREMENTS_NUM_MAX - (measurements_full ? MEASUREMENTS_NUM_MAX : measurements_count);
+    while(aggregates_closed_next < aggregates_closed_count && room - emitted >= AGGREGATE_NUM_MAX - 1) {
+        aggregate_series_t *series = &aggregates_closed[aggregates_closed_next++];
+        emit(series, AGGREGATE_MIN, series->min);
+        emit(series, AGGREGATE_MAX, series->max);
+        emit(series, AGGREGATE_MEAN, series->sum / series->count);
+        emit(series, AGGREGATE_LAST, series->row.value);
+        emit(series, AGGREGATE_COUNT, series->count);
+        emitted += AGGREGATE_NUM_MAX - 1;
+    }
+    if(aggregates_closed_next < aggregates_closed_count)
+        ESP_LOGI(__func__, "%u series left for the next pass", aggregates_closed_count - aggregates_closed_next);
+    return emitted;
+}
@@ -0,0 +1,25 @@
+// Copyright (c) 2024 José Francisco Castro <me@fran.cc>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef aggregates_h
+#define aggregates_h
+
+#define AGGREGATES_NUM_MAX	MEASUREMENTS_NUM_MAX	// series per window, as many as rows in a full ring
+
+#include <stdint.h>
+
+#include "measurements.h"
+
+typedef struct {
+	measurement_t row;				// last sample of the series
+	float min;
+	float max;
+	double sum;
+	uint32_t count;
+} aggregate_series_t;
+
+void aggregates_init();
+bool aggregates_update();
+void aggregates_resolve(int64_t shift);
+
+#endif
@@ -0,0 +1,336 @@
+// Copyright (c) 2024 José Francisco Castro <me@fran.cc>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <string.h>
+
+#include <esp_log.h>
+#include <nvs_flash.h>
+
+#include "alarms.h"
+#include "enums.h"
+#include "measurements.h"
+#include "postman.h"
+#include "schema.h"
+
+alarm_t alarms[ALARMS_NUM_MAX];
+// series beyond the threshold of each alarm, crossings are detected per series across wakes
+RTC_DATA_ATTR uint32_t alarms_active_series[ALARMS_ACTIVE_NUM_MAX];
+RTC_DATA_ATTR uint8_t alarms_active_alarm[ALARMS_ACTIVE_NUM_MAX];
+RTC_DATA_ATTR uint8_t alarms_active_count = 0;
+bool alarms_triggered = false;
+
+measurement_t alarms_rows[ALARMS_ROWS_NUM_MAX];
+uint8_t alarms_rows_count = 0;
+
+void alarms_init()
+{
+    memset(alarms, 0, sizeof(alarms));
+    alarms_read_from_nvs();
+}
+
+bool alarms_read_from_nvs()
+{
+    esp_err_t err;
+    nvs_handle_t handle;
+    char nvs_key[16];
+    size_t length;
+
+    err = nvs_open("alarms", NVS_READWRITE, &handle);
+    if(err == ESP_OK) {
+        for(uint8_t i = 0; i < ALARMS_NUM_MAX; i++) {
+            bool ok = true;
+            snprintf(nvs_key, sizeof(nvs_key), "%u_metric", i);
+            ok = ok && !nvs_get_u16(handle, nvs_key, &(alarms[i].metric));
+            snprintf(nvs_key, sizeof(nvs_key), "%u_condition", i);
+            ok = ok && !nvs_get_u8(handle, nvs_key, &(alarms[i].condition));
+            snprintf(nvs_key, sizeof(nvs_key), "%u_threshold", i);
+            length = sizeof(alarms[i].threshold);
+            ok = ok && !nvs_get_blob(handle, nvs_key, &(alarms[i].threshold), &length);
+            if(!ok || alarms[i].metric >= METRIC_NUM_MAX || alarms[i].condition >= ALARM_CONDITION_NUM_MAX)
+                memset(&alarms[i], 0, sizeof(alarm_t));
+        }
+        nvs_close(handle);
+        ESP_LOGI(__func__, "done");
+        return true;
+    }
+    else {
+        ESP_LOGI(__func__, "nvs_open failed");
+        return false;
+    }
+}
+
+bool alarms_write_to_nvs()
+{
+    esp_err_t err;
+    bool ok = true;
+    nvs_handle_t handle;
+    char nvs_key[16];
+
+    err = nvs_open("alarms", NVS_READWRITE, &handle);
+    if(err == ESP_OK) {
+        for(uint8_t i = 0; i < ALARMS_NUM_MAX && ok; i++) {
+            snprintf(nvs_key, sizeof(nvs_key), "%u_metric", i);
+            ok = ok && !nvs_set_u16(handle, nvs_key, alarms[i].metric);
+            snprintf(nvs_key, sizeof(nvs_key), "%u_condition", i);
+            ok = ok && !nvs_set_u8(handle, nvs_key, alarms[i].condition);
+            snprintf(nvs_key, sizeof(nvs_key), "%u_threshold", i);
+            ok = ok && !nvs_set_blob(handle, nvs_key, &(alarms[i].threshold), sizeof(alarms[i].threshold));
+        }
+        ok = ok && !nvs_commit(handle);
+        nvs_close(handle);
+        ESP_LOGI(__func__, "%s", ok ? "done" : "failed");
+        return ok;
+    }
+    else {
+        ESP_LOGI(__func__, "nvs_open failed");
+        return false;
+    }
+}
+
+// folds the node, descriptor and address of a row, the series of the same metric are told apart by it
+static uint32_t alarms_series_key(measurements_index_t index)
+{
+    uint64_t key = measurements[index].node * 0x9E3779B97F4A7C15ULL ^ measurements[index].address ^
+                   measurements_build_descriptor(measurements[index].node & 0xFF, measurements[index].resource,
+                                                 measurements[index].bus, measurements[index].multiplexer,
+                                                 measurements[index].channel, measurements[index].part,
+                                                 measurements[index].parameter, measurements[index].metric,
+                                                 measurements[index].unit);
+    return key ^ key >> 32;
+}
+
+static int alarms_find_active(uint8_t alarm, uint32_t series)
+{
+    for(int j = 0; j < alarms_active_count; j++)
+        if(alarms_active_alarm[j] == alarm && alarms_active_series[j] == series)
+            return j;
+    return -1;
+}
+
+static bool alarms_find_any_active(uint8_t alarm)
+{
+    for(int j = 0; j < alarms_active_count; j++)
+        if(alarms_active_alarm[j] == alarm)
+            return true;
+    return false;
+}
+
+static void alarms_clear_active(uint8_t alarm)
+{
+    for(int j = 0; j < alarms_active_count; j++)
+        if(alarms_active_alarm[j] == alarm) {
+            alarms_active_count--;
+            alarms_active_alarm[j] = alarms_active_alarm[alarms_active_count];
+            alarms_active_series[j--] = alarms_active_series[alarms_active_count];
+        }
+}
+
+// checks the rows added to the ring from index first on, an alarm triggers when a series crosses its threshold either way
+void alarms_check(measurements_index_t first)
+{
+    alarms_triggered = false;
+    alarms_rows_count = 0;
+    for(measurements_index_t index = first; index != measurements_count; index = (index + 1) % MEASUREMENTS_NUM_MAX) {
+        bool kept = false;
+        uint32_t series = 0;
+        for(uint8_t i = 0; i < ALARMS_NUM_MAX; i++) {
+            if(alarms[i].condition == ALARM_CONDITION_NONE || alarms[i].metric != measurements[index].metric)
+                continue;
+            bool beyond = alarms[i].condition == ALARM_CONDITION_ABOVE ? measurements[index].value > alarms[i].threshold :
+                                                                         measurements[index].value < alarms[i].threshold;
+            series = series ? series : alarms_series_key(index);
+            int j = alarms_find_active(i, series);
+            if(beyond == (j >= 0))
+                continue;
+            if(beyond && alarms_active_count == ALARMS_ACTIVE_NUM_MAX) {
+                ESP_LOGE(__func__, "alarm %u: too many series beyond their thresholds", i);
+                continue;
+            }
+            if(beyond) {
+                alarms_active_alarm[alarms_active_count] = i;
+                alarms_active_series[alarms_active_count++] = series;
+            }
+            else {
+                alarms_active_count--;
+                alarms_active_alarm[j] = alarms_active_alarm[alarms_active_count];
+                alarms_active_series[j] = alarms_active_series[alarms_active_count];
+            }
+            alarms_triggered = true;
+            ESP_LOGI(__func__, "alarm %u %s: %s %f", i, beyond ? "raised" : "cleared", metric_labels[alarms[i].metric], measurements[index].value);
+            if(!kept && alarms_rows_count < ALARMS_ROWS_NUM_MAX) {
+                memcpy(&alarms_rows[alarms_rows_count++], &measurements[index], sizeof(measurement_t));
+                kept = true;
+            }
+        }
+    }
+}
+
+// whether a series of the metric going from one value to the other crosses the threshold of an alarm
+bool alarms_crossed(measurement_metric_t metric, float from, float to)
+{
+    for(uint8_t i = 0; i < ALARMS_NUM_MAX; i++) {
+        if(alarms[i].condition == ALARM_CONDITION_NONE || alarms[i].metric != metric)
+            continue;
+        if(alarms[i].condition == ALARM_CONDITION_ABOVE ? (from > alarms[i].threshold) != (to > alarms[i].threshold) :
+                                                          (from < alarms[i].threshold) != (to < alarms[i].threshold))
+            return true;
+    }
+    return false;
+}
+
+// leaves in the ring just the rows that triggered an alarm
+void alarms_keep_rows()
+{
+    measurements_init();
+    for(uint8_t i = 0; i < alarms_rows_count; i++)
+        measurements_append(alarms_rows[i].node, alarms_rows[i].resource, alarms_rows[i].bus, alarms_rows[i].multiplexer,
+                            alarms_rows[i].channel, alarms_rows[i].address, alarms_rows[i].part, alarms_rows[i].parameter,
+                            alarms_rows[i].metric, alarms_rows[i].timestamp, alarms_rows[i].unit, alarms_rows[i].value);
+}
+
+static bool write_resource_schema(bp_pack_t *writer)
+{
+    bool ok = true;
+    ok = ok && bp_create_container(writer, BP_LIST);
+        ok = ok && bp_put_integer(writer, SCHEMA_LIST | SCHEMA_INDEX | SCHEMA_READ_ONLY);
+        ok = ok && bp_create_container(writer, BP_LIST);
+            ok = ok && bp_put_integer(writer, SCHEMA_INTEGER | SCHEMA_IDENTIFIER);
+        ok = ok && bp_finish_container(writer);
+    ok = ok && bp_finish_container(writer);
+    return ok;
+}
+
+static bool write_item_schema(bp_pack_t *writer)
+{
+    bool ok = true;
+    ok = ok && bp_create_container(writer, BP_LIST);
+        ok = ok && bp_put_integer(writer, SCHEMA_MAP);
+        ok = ok && bp_create_container(writer, BP_MAP);
+
+            ok = ok && bp_put_string(writer, "metric");
+            ok = ok && bp_create_container(writer, BP_LIST);
+                ok = ok && bp_put_integer(writer, SCHEMA_STRING | SCHEMA_VALUES);
+                ok = ok && bp_create_container(writer, BP_LIST);
+                for(int i = 0; i < METRIC_NUM_MAX; i++)
+                    ok = ok && bp_put_string(writer, metric_labels[i]);
+                ok = ok && bp_finish_container(writer);
+            ok = ok && bp_finish_container(writer);
+
+            ok = ok && bp_put_string(writer, "condition");
+            ok = ok && bp_create_container(writer, BP_LIST);
+                ok = ok && bp_put_integer(writer, SCHEMA_STRING | SCHEMA_VALUES);
+                ok = ok && bp_create_container(writer, BP_LIST);
+                for(int i = 0; i < ALARM_CONDITION_NUM_MAX; i++)
+                    ok = ok && bp_put_string(writer, alarm_condition_labels[i]);
+                ok = ok && bp_finish_container(writer);
+            ok = ok && bp_finish_container(writer);
+
+            ok = ok && bp_put_string(writer, "threshold");
+            ok = ok && bp_create_container(writer, BP_LIST);
+                ok = ok && bp_put_integer(writer, SCHEMA_FLOAT);
+            ok = ok && bp_finish_container(writer);
+
+            ok = ok && bp_put_string(writer, "active");
+            ok = ok && bp_create_container(writer, BP_LIST);
+                ok = ok && bp_put_integer(writer, SCHEMA_BOOLEAN | SCHEMA_READ_ONLY);
+            ok = ok && bp_finish_container(writer);
+
+        ok = ok && bp_finish_container(writer);
+    ok = ok && bp_finish_container(writer);
+    return ok;
+}
+
+bool alarms_schema_handler(char *resource_name, bp_pack_t *writer)
+{
+    bool ok = true;
+
+    // GET
+    ok = ok && bp_create_container(writer, BP_LIST);
+        ok = ok && bp_create_container(writer, BP_LIST);                                // Path
+            ok = ok && bp_put_string(writer, resource_name);
+        ok = ok && bp_finish_container(writer);
+        ok = ok && bp_put_integer(writer, SCHEMA_GET_RESPONSE);                         // Methods
+        ok = ok && write_resource_schema(writer);                                       // Schema
+    ok = ok && bp_finish_container(writer);
+
+    // GET item / PUT item
+    ok = ok && bp_create_container(writer, BP_LIST);
+        ok = ok && bp_create_container(writer, BP_LIST);                                // Path
+            ok = ok && bp_put_string(writer, resource_name);
+            ok = ok && bp_put_none(writer);
+        ok = ok && bp_finish_container(writer);
+        ok = ok && bp_put_integer(writer, SCHEMA_GET_RESPONSE | SCHEMA_PUT_REQUEST);    // Methods
+        ok = ok && write_item_schema(writer);                                           // Schema
+    ok = ok && bp_finish_container(writer);
+
+    return ok;
+}
+
+uint32_t alarms_resource_handler(uint32_t method, bp_pack_t *reader, bp_pack_t *writer)
+{
+    bool ok = true;
+    uint32_t index;
+
+    if(method == PM_GET) {
+        if(bp_next(reader)) {
+            if(!bp_is_integer(reader) || (index = bp_get_integer(reader)) > ALARMS_NUM_MAX - 1)
+                return PM_400_Bad_Request;
+
+            ok = ok && bp_create_container(writer, BP_MAP);
+            ok = ok && bp_put_string(writer, "metric") && bp_put_string(writer, metric_labels[alarms[index].metric]);
+            ok = ok && bp_put_string(writer, "condition") && bp_put_string(writer, alarm_condition_labels[alarms[index].condition]);
+            ok = ok && bp_put_string(writer, "threshold") && bp_put_float(writer, alarms[index].threshold);
+            ok = ok && bp_put_string(writer, "active") && bp_put_boolean(writer, alarms_find_any_active(index));
+            ok = ok && bp_finish_container(writer);
+        }
+        else {
+            ok = ok && bp_create_container(writer, BP_LIST);
+            for(index = 0; index != ALARMS_NUM_MAX && ok; index++)
+                ok = ok && bp_put_integer(writer, index);
+            ok = ok && bp_finish_container(writer);
+        }
+        return ok ? PM_205_Content : PM_500_Internal_Server_Error;
+    }
+    else if(method == PM_PUT) {
+        if(!bp_next(reader) || !bp_is_integer(reader) || (index = bp_get_integer(reader)) > ALARMS_NUM_MAX - 1 ||
+           !bp_close(reader) || !bp_next(reader) || !bp_is_map(reader) || !bp_open(reader))
+            return PM_400_Bad_Request;
+
+        alarm_t alarm = {0};
+        while(ok && bp_next(reader)) {
+            if(bp_match(reader, "metric")) {
+                int i;
+                for(i = 0; i < METRIC_NUM_MAX; i++)
+                    if(bp_equals(reader, metric_labels[i]))
+                        break;
+                if(i < METRIC_NUM_MAX)
+                    alarm.metric = i;
+                else
+                    ok = false;
+            }
+            else if(bp_match(reader, "condition")) {
+                int i;
+                for(i = 0; i < ALARM_CONDITION_NUM_MAX; i++)
+                    if(bp_equals(reader, alarm_condition_labels[i]))
+                        break;
+                if(i < ALARM_CONDITION_NUM_MAX)
+                    alarm.condition = i;
+                else
+                    ok = false;
+            }
+            else if(bp_match(reader, "threshold"))
+                alarm.threshold = bp_get_float(reader);
+            else bp_next(reader);
+        }
+        bp_close(reader);
+
+        if(!ok)
+            return PM_400_Bad_Request;
+
+        alarms[index] = alarm;
+        alarms_clear_active(index);
+        return alarms_write_to_nvs() ? PM_204_Changed : PM_500_Internal_Server_Error;
+    }
+    else
+        return PM_405_Method_Not_Allowed;
+}
@@ -0,0 +1,32 @@
+// Copyright (c) 2024 José Francisco Castro <me@fran.cc>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef alarms_h
+#define alarms_h
+
+#define ALARMS_NUM_MAX		8
+#define ALARMS_ROWS_NUM_MAX	8		// rows sent on an alarm, one per alarm is the usual case
+#define ALARMS_ACTIVE_NUM_MAX	16		// series beyond the threshold of an alarm, across all alarms
+
+#include "bigpacks.h"
+#include "measurements.h"
+
+typedef struct {
+	measurement_metric_t metric;
+	uint8_t condition;
+	float threshold;
+} alarm_t;
+
+extern alarm_t alarms[];
+extern bool alarms_triggered;
+
+void alarms_init();
+bool alarms_read_from_nvs();
+bool alarms_write_to_nvs();
+void alarms_check(measurements_index_t first);
+bool alarms_crossed(measurement_metric_t metric, float from, float to);
+void alarms_keep_rows();
+bool alarms_schema_handler(char *resource_name, bp_pack_t *writer);
+uint32_t alarms_resource_handler(uint32_t method, bp_pack_t *reader, bp_pack_t *writer);
+
+#endif
@@ -10,9 +10,6 @@
 #include <esp_sntp.h>
 #include <nvs_flash.h>
 #include <driver/uart.h>
-#include <esp_tls.h>
-#include <esp_crt_bundle.h>
-#include <esp_http_client.h>
 #include <mqtt_client.h>
 
 #if defined(CONFIG_IDF_TARGET_ESP32C3) || defined(CONFIG_IDF_TARGET_ESP32C6) || defined(CONFIG_IDF_TARGET_ESP32S3)
@@ -28,14 +25,18 @@
 #endif
 
 #include "adc.h"
+#include "aggregates.h"
+#include "alarms.h"
 #include "application.h"
 #include "ble.h"
 #include "board.h"
 #include "backends.h"
+#include "cbor.h"
+#include "deadbands.h"
+#include "derived.h"
 #include "devices.h"
 #include "enums.h"
 #include "framer.h"
-#include "httpdate.h"
 #include "i2c.h"
 #include "logs.h"
 #include "measurements.h"
@@ -44,6 +45,7 @@
 #include "onewire.h"
 #include "postman.h"
 #include "schema.h"
+#include "uploads.h"
 #include "wifi.h"
 #include "yuarel.h"
 
@@ -57,11 +59,8 @@ postman_t postman;
 
 uint32_t postman_buffer[POSTMAN_PACKET_LENGTH_MAX / 4];
 
-size_t backend_buffer_length = 0;
 alignas(4) char backend_buffer[POSTMAN_PACKET_LENGTH_MAX];
 
-time_t http_timestamp = 0;
-
 bool sntp_started = false;
 extern bool backends_started;
 RTC_DATA_ATTR bool slept_once = false;
@@ -179,77 +178,86 @@ void serial_send_receive()
 
     while(framer.state == FRAMER_RECEIVING && serial_read_bytes(&byte, 1)) {
         if(framer_put_received_byte(&framer, byte) && framer.length) {
+            uploads_lock();
             framer.length = postman_handle_pack(&postman, postman_buffer, framer.length / 4, sizeof(postman_buffer) / 4, 0, NULL, NULL) * 4;
+            uploads_unlock();
             framer_set_state(&framer, FRAMER_SENDING);
             break;
         }
     }
 }
 
-#ifndef MIN
-#define MIN(a,b) (((a)<(b))?(a):(b))
-#endif
-
-esp_err_t http_event_handler(esp_http_client_event_t *event)
+// Publishes every row, or every wide row of a device, as a retained message at <output_topic>/<path>.
+// The topic keeps the output topic and the base path of the device while rows of the same device follow.
+// Messages are only enqueued, the MQTT client task sends them back to back.
+void mqtt_publish_series(uint8_t i)
 {
-    switch(event->event_id) {
-        case HTTP_EVENT_ON_CONNECTED:
-             backend_buffer_length = 0;
-             break;
-        case HTTP_EVENT_ON_HEADER:
-            if(!strncmp(event->header_key, "Date", 5))
-                httpdate_parse(event->header_value, &http_timestamp);
-            break;
-        case HTTP_EVENT_ON_DATA:
-            if (!esp_http_client_is_chunked_response(event->client)) {
-                size_t copy_len = MIN(event->data_len, (sizeof(backend_buffer) - 1 - backend_buffer_length));
-                if(copy_len)
-                    memcpy(backend_buffer + backend_buffer_length, event->data, copy_len);
-                backend_buffer_length += copy_len;
-            }
-            break;
-        default:
-            break;
+    static char topic[BACKEND_TOPIC_LENGTH + MEASUREMENTS_PATH_LENGTH];
+    pbuf_t topic_buf = { topic, sizeof(topic), 0 };
+    measurements_index_t index;
+    measurements_index_t base_index = 0;
+    measurements_index_t count = measurements_full ? MEASUREMENTS_NUM_MAX : measurements_count;
+    size_t base_length = 0;        // of the topic up to the base path of base_index, 0 until built
+    bool wide = backends[i].format == BACKEND_FORMAT_TEMPLATE && measurements_template_is_wide(backends[i].template_row);
+    bool window_full = false;
+    int published = 0;
+    int err = 0;
+    int n;
+
+    if(backends[i].format == BACKEND_FORMAT_BATCH) {      // mixes series in a datagram
+        backends[i].status = BACKEND_STATUS_ERROR;
+        backends[i].error = ESP_ERR_INVALID_ARG;
+        strlcpy(backends[i].message, "Unsupported format", sizeof(backends[i].message));
+        return;
     }
-    return ESP_OK;
-}
-
-size_t encode_measurements(uint8_t backend_index)
-{
-    bool ok = true;
-    size_t length = sizeof(backend_buffer);
-
-    switch(backends[backend_index].format) {
-        case BACKEND_FORMAT_SENML:
-            ok = ok && measurements_to_senml(backend_buffer, &length);
-            break;
-        case BACKEND_FORMAT_POSTMAN:
-            ok = ok && measurements_to_postman(backend_buffer, &length,
-                backends[backend_index].auth == BACKEND_AUTH_POSTMAN ? backends[backend_index].user : NULL,
-                backends[backend_index].auth == BACKEND_AUTH_POSTMAN ? backends[backend_index].key : NULL);
-            break;
-        case BACKEND_FORMAT_TEMPLATE:
-            ok = ok && measurements_to_template(backend_buffer, &length,
-                backends[backend_index].template_header, backends[backend_index].template_row,
-                backends[backend_index].template_row_separator, backends[backend_index].template_path_separator,
-                backends[backend_index].template_footer);
+    measurements_resolve();
+    measurements_select(i);
+    bool ok = pbuf_printf(&topic_buf, "%s/", backends[i].output_topic);
+    size_t prefix_length = topic_buf.length;
+    for(n = 0; n < count && ok && err >= 0; n++) {
+        pbuf_t buf = { backend_buffer, sizeof(backend_buffer), 0 };
+        index = measurements_full ? (measurements_count + n) % MEASUREMENTS_NUM_MAX : n;
+        if(!measurements_selected(index))
+            continue;
+        if(backends[i].qos && backends_in_flight(i) >= BACKEND_MQTT_SERIES_WINDOW) {
+            window_full = true;
             break;
-        default:
-            ok = false;
+        }
+        if(!base_length || !measurements_have_same_base(index, base_index)) {
+            topic_buf.length = prefix_length;
+            ok = ok && measurements_build_base_path(&topic_buf, index, '/');
+            base_index = index;
+            base_length = topic_buf.length;
+        }
+        topic_buf.length = base_length;
+        if(wide)
+            topic[--topic_buf.length] = 0;      // the device, without the trailing separator
+        else
+            ok = ok && measurements_build_leaf_path(&topic_buf, index, '/');
+        n += uploads_encode_row(i, n, count, &buf) - 1;
+        if(!ok || !buf.length)
+            continue;
+        if(backends[i].qos) {
+            backends[i].published++;    // before enqueuing, the acknowledgement may come first
+            backends[i].published_time = esp_timer_get_time();
+        }
+        err = esp_mqtt_client_enqueue(backends[i].handle, topic, buf.data, buf.length, backends[i].qos, 1, true);
+        if(err < 0 && backends[i].qos)
+            backends[i].published--;
+        published += err >= 0;
     }
-
-    ESP_LOGI(__func__, "backend buffer length / size: %u / %u", length, sizeof(backend_buffer));
-
-    if(!ok && !length)
-        ESP_LOGE(__func__, "backend buffer overflow!");
-
-    if(!ok) {
-        backends[backend_index].status = BACKEND_STATUS_ERROR;
-        backends[backend_index].error = 0x201; // Serialization failed
-        backends[backend_index].message[0] = 0;
-        length = 0;
+    for(; window_full && n < count; n++) {     // messages left out by the full window
+        index = measurements_full ? (measurements_count + n) % MEASUREMENTS_NUM_MAX : n;
+        if(measurements_selected(index)) {
+            backends[i].dropped++;
+            n += wide ? measurements_group_length(n, count) - 1 : 0;
+        }
     }
-    return length;
+    measurements_select(-1);
+    backends[i].status = err < 0 || !ok || window_full ? BACKEND_STATUS_ERROR : BACKEND_STATUS_ONLINE;
+    backends[i].error = err < 0 ? err : 0;
+    strlcpy(backends[i].message, !ok ? "Topic too long" : window_full ? "In-flight window full" : "", sizeof(backends[i].message));
+    ESP_LOGI(__func__, "%i messages enqueued for backend %i under %s", published, i, backends[i].output_topic);
 }
 
 void app_main(void)
@@ -258,20 +266,26 @@ void app_main(void)
     int64_t now;
     bool ready_to_sleep = false;
     bool measurements_updated = false;
+    bool measurements_saved = false;
+    bool aggregating = false;
+    bool aggregated = false;
 
     esp_event_loop_create_default();
 
-    struct timeval zero_time = { .tv_sec = 0 };   // Reset system time to avoid using the unreliable internal RTC
-    settimeofday(&zero_time, NULL);
+    now_init();         // kept across deep sleep
 
     logs_init();        // order of inits is important!
     serial_init();
     nvs_init();         // 100 ms
     board_init();
+    application_init(); // decides if this wake uploads
     wifi_init();        // 160 ms
-    application_init();
     nodes_init();
+    alarms_init();
+    deadbands_init();
+    derived_init();
     backends_init(); // 47 ms
+    uploads_init();
     measurements_init();
     adc_init();
     ble_init();
@@ -285,10 +299,12 @@ void app_main(void)
     postman_init(&postman);
     postman_register_resource(&postman, "@", &schema_resource_handler);
     postman_register_resource(&postman, "adc", &adc_resource_handler);
+    postman_register_resource(&postman, "alarms", &alarms_resource_handler);
     postman_register_resource(&postman, "application", &application_resource_handler);
     postman_register_resource(&postman, "ble", &ble_resource_handler);
     postman_register_resource(&postman, "board", &board_resource_handler);
     postman_register_resource(&postman, "backends", &backends_resource_handler);
+    postman_register_resource(&postman, "deadbands", &deadbands_resource_handler);
     postman_register_resource(&postman, "devices", &devices_resource_handler);
     postman_register_resource(&postman, "i2c", &i2c_resource_handler);
     postman_register_resource(&postman, "logs", &logs_resource_handler);
@@ -318,14 +334,18 @@ void app_main(void)
         }
 
         if(wifi.disconnected) {
+            uploads_lock();
             backends_stop();
             backends_clear_status();
+            uploads_unlock();
             wifi.disconnected = false;
             ESP_LOGI(__func__, "wifi disconnection detected");
         }
 
         if(wifi.reconnected) {
+            uploads_lock();
             backends_start();
+            uploads_unlock();
             wifi.reconnected = false;
             ESP_LOGI(__func__, "wifi connection detected");
         }
@@ -341,9 +361,22 @@ void app_main(void)
             ESP_LOGI(__func__, "starting measurements @ %lli", now);
             application.last_measurement_time = now;
             application.next_measurement_time += application.sampling_period * 1000000L;
+            application.deadline = now + application.wake_budget * 1000LL;
             ESP_LOGI(__func__, "last_measurement_time %lli next_measurement_time %lli", (long long int)application.last_measurement_time, (long long int)application.next_measurement_time);
-            if(!application.queue)
+            if(wifi.ssid[0] && application.upload)    // TLS handshakes and MQTT connections overlap the measurements
+                for(uint8_t i = 0; i != BACKENDS_NUM_MAX; i++)
+                    if(backends[i].uri[0] == 'h' || (backends[i].uri[0] == 'm' && !backends_started))
+                        uploads_submit(i, UPLOADS_JOB_CONNECT, false);
+
+            uploads_lock();     // workers encode the ring and handle postman requests
+            if(!application.queue) {
+                uploads_drop_waiting();
                 measurements_init();
+            }
+            if(measurements_saved_count)
+                measurements_restore();
+            measurements_resolve();
+            measurements_index_t first = measurements_count;    // of the rows added by this pass
             measurements_measure();
             // stop the scan if not in continuous mode or there are BLE measurements
             if(ble.receive && (ble.scan_duration != 0xFF || ble_measurements_count)) {
@@ -351,9 +384,26 @@ void app_main(void)
                 ESP_LOGI(__func__, "ble_measurements_count: %lu", ble_measurements_count);
                 ble_merge_measurements();
             }
+            alarms_check(first);    // on the BLE rows too
+            aggregating = application.aggregation_window && !application.sleep;     // windows do not survive deep sleep
+            aggregated = aggregating && aggregates_update();
+            uploads_unlock();
             if(!application.queue && measurements_full)
                 ESP_LOGE(__func__, "measurements buffer overflow!");
-            measurements_updated = true;
+            measurements_updated = !aggregating || aggregated;
+            if(!application.upload && alarms_triggered) {
+                // all rows wait for the next scheduled upload, only the triggering ones are sent now
+                measurements_save();
+                measurements_saved = true;
+                uploads_lock();
+                alarms_keep_rows();
+                uploads_unlock();
+                application.upload = true;
+                wifi_start();
+                ESP_LOGI(__func__, "alarm triggered, starting wifi @ %lli", esp_timer_get_time());
+            }
+            else if(!application.upload)
+                ready_to_sleep = true;      // the rows are saved until the next upload
             ESP_LOGI(__func__, "finished measurements @ %lli", esp_timer_get_time());
         }
 
@@ -369,141 +419,45 @@ void app_main(void)
 
         if(wifi.status == WIFI_STATUS_ONLINE && ((measurements_updated && (measurements_count || measurements_full)) || backends_modified)) {
             wifi_measure();
+            uploads_lock();
+            uploads_clear_payload();    // the ring or the backends may have changed since the last cycle
+            uploads_unlock();
             for(uint8_t i = 0; i != BACKENDS_NUM_MAX; i++) {
                 if(backends[i].uri[0] == 0 || (backends_modified && !(backends_modified & 1 << i)))
                     continue;
 
                 ESP_LOGI(__func__, "started sending measurements via WiFi @ %lli", esp_timer_get_time());
                 switch(backends[i].uri[0]) {
-                case 'h': {     // http / https
-                    esp_http_client_config_t config_post = {
-                        .url = backends[i].uri,
-                        .cert_pem = backends[i].server_cert[0] ? backends[i].server_cert : NULL,
-                        .crt_bundle_attach = backends[i].server_cert[0] ? NULL : esp_crt_bundle_attach,
-                        .is_async = false,
-                        .timeout_ms = 7000,
-                        .event_handler = http_event_handler,
-                    };
-
-                    esp_http_client_handle_t client = esp_http_client_init(&config_post);
-                    if(!client) {
+                case 'h':   // http / https, encoded now and sent by the upload worker of the backend
+                    if(!uploads_submit(i, UPLOADS_JOB_SEND, backends_modified & 1 << i))
+                        ESP_LOGE(__func__, "previous upload to backend %i still in progress, batch queued", i);
+                    break;
+                case 'm':   // mqtt / mqtts
+                    size_t payload_length;
+                    uploads_lock();
+                    if(backends_started && backends[i].topic_per_series)
+                        mqtt_publish_series(i);
+                    else if(backends_started && backends[i].qos && backends_in_flight(i) >= BACKEND_MQTT_WINDOW) {
+                        // the outbox already holds a window of unacknowledged payloads, the broker is not keeping up
                         backends[i].status = BACKEND_STATUS_ERROR;
-                        backends[i].error = ESP_ERR_INVALID_ARG;
-                        backends[i].message[0] = 0;
-                        continue;
-                    }
-
-                    switch(backends[i].auth) {
-                        case BACKEND_AUTH_BASIC:
-                            esp_http_client_set_authtype(client, HTTP_AUTH_TYPE_BASIC);
-                            esp_http_client_set_username(client, backends[i].user);
-                            esp_http_client_set_password(client, backends[i].key);
-                            break;
-                        case BACKEND_AUTH_DIGEST:
-                            esp_http_client_set_authtype(client, HTTP_AUTH_TYPE_DIGEST);
-                            esp_http_client_set_username(client, backends[i].user);
-                            esp_http_client_set_password(client, backends[i].key);
-                            break;
-                        case BACKEND_AUTH_BEARER:
-                            snprintf(backend_buffer, sizeof(backend_buffer), "Bearer %s", backends[i].key);
-                            esp_http_client_set_header(client, "Authorization", backend_buffer);
-                            break;
-                        case BACKEND_AUTH_TOKEN:
-                            snprintf(backend_buffer, sizeof(backend_buffer), "Token %s", backends[i].key);
-                            esp_http_client_set_header(client, "Authorization", backend_buffer);
-                            break;
-                        case BACKEND_AUTH_HEADER:
-                            esp_http_client_set_header(client, backends[i].user, backends[i].key);
-                            break;
+                        strlcpy(backends[i].message, "In-flight window full", sizeof(backends[i].message));
+                        ESP_LOGE(__func__, "%lu messages in flight to backend %i", backends_in_flight(i), i);
                     }
-
-                    if(!NOW && (backends[i].auth == BACKEND_AUTH_POSTMAN || strstr(backends[i].template_row, "@t"))) {
-                        http_timestamp = 0;
-                        backend_buffer_length = 0;
-                        esp_http_client_set_method(client, HTTP_METHOD_HEAD);
-                        err = esp_http_client_perform(client);
-                        if(err == ESP_OK) {
-                            struct timeval now = { .tv_sec = http_timestamp };
-                            settimeofday(&now, NULL);
-                            ESP_LOGI(__func__, "System time set to HTTP Date: %lli", http_timestamp);
-                        }
-                        else {
-                            backends[i].status = BACKEND_STATUS_ERROR;
-                            backends[i].error = err;
-                            backends[i].message[0] = 0;
-                            continue;
-                        }
-                    }
-
-                    if(backends[i].content_type[0])
-                        esp_http_client_set_header(client, "Content-Type", backends[i].content_type);
-                    else {
-                        switch(backends[i].format) {
-                            case BACKEND_FORMAT_SENML:
-                                esp_http_client_set_header(client, "Content-Type", "application/json"); break;
-                            case BACKEND_FORMAT_POSTMAN:
-                                esp_http_client_set_header(client, "Content-Type", "application/vnd.postman"); break;
-                            case BACKEND_FORMAT_TEMPLATE:
-                                esp_http_client_set_header(client, "Content-Type", "text/plain; charset=utf-8"); break;
-                        }
-                    }
-
-                    backend_buffer_length = encode_measurements(i);
-                    if(!backend_buffer_length)
-                        continue;
-
-                    esp_http_client_set_method(client, HTTP_METHOD_POST);
-                    esp_http_client_set_post_field(client, backend_buffer, backend_buffer_length);
-
-                    backend_buffer_length = 0;
-                    err = esp_http_client_perform(client);
-                    if(err == ESP_OK) {
-                        int status = esp_http_client_get_status_code(client);
-                        backends[i].status = status < 300 ? BACKEND_STATUS_ONLINE : BACKEND_STATUS_ERROR;
-                        backends[i].error = status + BACKEND_ERROR_HTTP_STATUS_BASE;
-                        backend_buffer[backend_buffer_length] = 0;
-                        strlcpy(backends[i].message, (char *)backend_buffer, sizeof(backends[i].message));
-
-                        if(status >= 300)
-                            ESP_LOGI(__func__, "HTTP Error %i: %s", status, backend_buffer);
-                        else if(backend_buffer_length && backends[i].format == BACKEND_FORMAT_POSTMAN && backends[i].auth == BACKEND_AUTH_POSTMAN) {
-                            hmac_sha256_key_t binary_key;
-                            if(hmac_hex_decode(binary_key, sizeof(binary_key), backends[i].key, strlen(backends[i].key)) == sizeof(binary_key)) {
-                                ESP_LOGI(__func__, "Handling HTTP Postman request");
-                                backend_buffer_length = sizeof(bp_type_t) * postman_handle_pack(&postman,
-                                    (bp_type_t *) backend_buffer,
-                                    backend_buffer_length / sizeof(bp_type_t),
-                                    sizeof(backend_buffer) / sizeof(bp_type_t),
-                                    NOW, backends[i].user, binary_key);
-                                ESP_LOGI(__func__, "HTTP Postman response: buffer length %u", backend_buffer_length);
-                                if(backend_buffer_length) {
-                                    esp_http_client_set_post_field(client, backend_buffer, backend_buffer_length);
-                                    backend_buffer_length = 0;
-                                    err = esp_http_client_perform(client);
-                                    status = esp_http_client_get_status_code(client);
-                                    ESP_LOGI(__func__, "HTTP Postman response: err %i status %i",err,status);
-                                }
-                            }
-                            else
-                                ESP_LOGI(__func__, "HMAC key is not 64 bytes long");
+                    else if(backends_started && (payload_length = uploads_encode(i, true)) != 0) {
+                        // enqueued messages are sent by the MQTT client task, so a slow broker does not block the loop
+                        if(backends[i].qos) {
+                            backends[i].published++;    // before enqueuing, the acknowledgement may come first
+                            backends[i].published_time = esp_timer_get_time();
                         }
-                    }
-                    else {
-                        backends[i].status = BACKEND_STATUS_ERROR;
-                        backends[i].error = err;
-                        backends[i].message[0] = 0;
-                    }
-                    esp_http_client_cleanup(client);
-                    break;
-                }
-                case 'm':   // mqtt / mqtts
-                    if(backends_started && (backend_buffer_length = encode_measurements(i)) != 0) {
-                        err = esp_mqtt_client_publish(backends[i].handle, backends[i].output_topic, backend_buffer, backend_buffer_length, 0, 0);
+                        err = esp_mqtt_client_enqueue(backends[i].handle, backends[i].output_topic, uploads_payload, payload_length, backends[i].qos, 0, true);
+                        if(err < 0 && backends[i].qos)
+                            backends[i].published--;
                         backends[i].status = err < 0 ? BACKEND_STATUS_ERROR : BACKEND_STATUS_ONLINE;
                         backends[i].error = err;
                         backends[i].message[0] = 0;
-                        ESP_LOGI(__func__, "esp_mqtt_client_publish: %s", err < 0 ? "failed" : "done");
+                        ESP_LOGI(__func__, "esp_mqtt_client_enqueue: %s", err < 0 ? "failed" : "done");
                     }
+                    uploads_unlock();
                     break;
                 case 'u':   // udp
                     measurements_index_t index = 0;
@@ -553,39 +507,22 @@ void app_main(void)
                         break;
                     }
 
+                    uploads_lock();     // the filter selection is shared with the upload workers
+                    measurements_resolve();
+                    measurements_select(i);
                     for(int n = 0; n < count; n++) {
                         pbuf_t buf = { backend_buffer, sizeof(backend_buffer), 0 };
                         index = measurements_full ? (measurements_count + n) % MEASUREMENTS_NUM_MAX : n;
-
-                        switch(backends[i].format) {
-                        case BACKEND_FORMAT_SENML:
-                            measurements_entry_to_senml_row(index, &buf);
-                            break;
-                        case BACKEND_FORMAT_POSTMAN:
-                            buf.length = buf.size;
-                            measurements_entry_to_postman(index, buf.data, &buf.length,
-                                backends[i].auth == BACKEND_AUTH_POSTMAN ? backends[i].user : NULL,
-                                backends[i].auth == BACKEND_AUTH_POSTMAN ? backends[i].key : NULL);
-                            break;
-                        case BACKEND_FORMAT_TEMPLATE:
-                            measurements_entry_to_template_row(index, &buf, backends[i].template_row, backends[i].template_path_separator);
-                            break;
-                        case BACKEND_FORMAT_FRAME:
-                            buf.length = sizeof(measurement_frame_t);
-                            measurements_entry_to_frame(index, (measurement_frame_t *) buf.data);
-                            break;
-                        default:
-                            backends[i].status = BACKEND_STATUS_ERROR;
-                            backends[i].error = ESP_ERR_INVALID_ARG;
-                            strlcpy(backends[i].message, "Unsupported format", sizeof(backends[i].message));
-                            ESP_LOGE(__func__, "Unsupported format at backend %i", i);
-                            break;
-                        }
+                        if(!measurements_selected(index))
+                            continue;
+                        n += uploads_encode_row(i, n, count, &buf) - 1;
                         if(buf.length) {
                             err = sendto(sock, buf.data, buf.length, 0, (struct sockaddr *) addr, addr_size);
                             ESP_LOGI(__func__, "sent measurement %i via UDP: %s %i", index, err < 0 ? "failed" : "done", err);
                         }
                     }
+                    measurements_select(-1);
+                    uploads_unlock();
                     close(sock);
                     if(application.sleep)
                         vTaskDelay (100 / portTICK_PERIOD_MS); // wait for WiFi TX pending packets to be sent, not sure about the 100ms
@@ -604,18 +541,22 @@ void app_main(void)
         }
 
         now = esp_timer_get_time();
-        if(application.sleep && framer.state != FRAMER_SENDING &&
-          (ready_to_sleep || (measurements_updated && now - application.last_measurement_time > 10 * 1000000)) &&
+        bool deadline_passed = application_time_left() <= 0;   // in-flight uploads and unacknowledged MQTT messages are abandoned
+        if(application.sleep && framer.state != FRAMER_SENDING && ((!uploads_busy() && !backends_busy()) || deadline_passed) &&
+          (ready_to_sleep || deadline_passed || (measurements_updated && now - application.last_measurement_time > 10 * 1000000)) &&
           (slept_once || now > 60 * 1000000)) {
             ready_to_sleep = false;
             int64_t sleep_duration = application.next_measurement_time - now - (ble.receive ? ble.scan_duration * 1000000 : 0);
             if(sleep_duration > 0) {
                 slept_once = true;
+                if(measurements_updated && !measurements_saved)    // not uploaded on this wake
+                    measurements_save();
                 wifi_stop();
                 ble_stop();
                 i2c_stop();
                 onewire_stop();
                 board_stop();
+                application_awake_time = esp_timer_get_time();  // the timer restarts from zero on every wake
                 esp_sleep_enable_timer_wakeup(sleep_duration);
                 esp_deep_sleep_start();
                 // this is never reached
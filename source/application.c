@@ -1,12 +1,15 @@
 // Copyright (c) 2024 José Francisco Castro <me@fran.cc>
 // SPDX-License-Identifier: GPL-3.0-or-later
 
+#include <math.h>
 #include <string.h>
 
 #include <esp_log.h>
+#include <esp_sleep.h>
 #include <esp_timer.h>
 #include <nvs_flash.h>
 
+#include "aggregates.h"
 #include "application.h"
 #include "board.h"
 #include "enums.h"
@@ -17,6 +20,25 @@
 #include "wifi.h"
 
 application_t application;
+RTC_DATA_ATTR int64_t application_awake_time = 0;     // of the previous wake, including WiFi and TLS setup
+RTC_DATA_ATTR uint16_t application_skipped_wakes = 0;  // since the last upload
+RTC_DATA_ATTR uint32_t application_period = 0;         // seconds, current sampling period with adaptive sampling
+RTC_DATA_ATTR application_series_t application_series[APPLICATION_SERIES_NUM_MAX];
+RTC_DATA_ATTR uint8_t application_series_count = 0;
+bool application_jumped = false;                        // in the current measurement pass
+bool application_stable = true;
+
+// sleeping nodes keep their rows in RTC memory and only bring up the radio every upload_every wakes
+static bool application_upload_due()
+{
+    if(!application.sleep || application.upload_every <= 1 || esp_sleep_get_wakeup_cause() != ESP_SLEEP_WAKEUP_TIMER ||
+       application_skipped_wakes + 1 >= application.upload_every || measurements_saved_nearly_full()) {
+        application_skipped_wakes = 0;
+        return true;
+    }
+    application_skipped_wakes++;
+    return false;
+}
 
 void application_init()
 {
@@ -24,8 +46,17 @@ void application_init()
     application.next_measurement_time = 0;
 
     application.diagnostics = false;
+    application.derived_humidity = false;
+    application.derived_aqi = false;
     application.sampling_period = 600;
+    application.max_sampling_period = 0;
+    application.adaptive_band = 0.01;
+    application.aggregation_window = 0;
+    application.wake_budget = 0;
+    application.upload_every = 1;
     application_read_from_nvs();
+    application.upload = application_upload_due();
+    application.deadline = application.wake_budget * 1000LL;     // until the first cycle starts, counted from the wake
 }
 
 bool application_read_from_nvs()
@@ -38,7 +69,15 @@ bool application_read_from_nvs()
         nvs_get_u8(handle, "queue", (uint8_t *) &(application.queue));
         nvs_get_u8(handle, "sleep", (uint8_t *) &(application.sleep));
         nvs_get_u8(handle, "diagnostics", (uint8_t *) &(application.diagnostics));
+        nvs_get_u8(handle, "derived_hum", (uint8_t *) &(application.derived_humidity));
+        nvs_get_u8(handle, "derived_aqi", (uint8_t *) &(application.derived_aqi));
         nvs_get_u32(handle, "sampling_period", &(application.sampling_period));
+        nvs_get_u32(handle, "max_sampling", &(application.max_sampling_period));
+        size_t length = sizeof(application.adaptive_band);
+        nvs_get_blob(handle, "adaptive_band", &(application.adaptive_band), &length);
+        nvs_get_u32(handle, "aggr_window", &(application.aggregation_window));
+        nvs_get_u32(handle, "wake_budget", &(application.wake_budget));
+        nvs_get_u16(handle, "upload_every", &(application.upload_every));
         nvs_close(handle);
         ESP_LOGI(__func__, "done");
         return true;
@@ -60,7 +99,14 @@ bool application_write_to_nvs()
         ok = ok && !nvs_set_u8(handle, "queue", application.queue);
         ok = ok && !nvs_set_u8(handle, "sleep", application.sleep);
         ok = ok && !nvs_set_u8(handle, "diagnostics", application.diagnostics);
+        ok = ok && !nvs_set_u8(handle, "derived_hum", application.derived_humidity);
+        ok = ok && !nvs_set_u8(handle, "derived_aqi", application.derived_aqi);
         ok = ok && !nvs_set_u32(handle, "sampling_period", application.sampling_period);
+        ok = ok && !nvs_set_u32(handle, "max_sampling", application.max_sampling_period);
+        ok = ok && !nvs_set_blob(handle, "adaptive_band", &(application.adaptive_band), sizeof(application.adaptive_band));
+        ok = ok && !nvs_set_u32(handle, "aggr_window", application.aggregation_window);
+        ok = ok && !nvs_set_u32(handle, "wake_budget", application.wake_budget);
+        ok = ok && !nvs_set_u16(handle, "upload_every", application.upload_every);
         ok = ok && !nvs_commit(handle);
         nvs_close(handle);
         ESP_LOGI(__func__, "%s", ok ? "done" : "failed");
@@ -120,6 +166,40 @@ static bool write_resource_schema(bp_pack_t *writer)
                 ok = ok && bp_put_integer(writer, 0);
             ok = ok && bp_finish_container(writer);
 
+            ok = ok && bp_put_string(writer, "max_sampling_period");
+            ok = ok && bp_create_container(writer, BP_LIST);
+                ok = ok && bp_put_integer(writer, SCHEMA_INTEGER | SCHEMA_MINIMUM);
+                ok = ok && bp_put_integer(writer, 0);
+            ok = ok && bp_finish_container(writer);
+
+            ok = ok && bp_put_string(writer, "adaptive_band");
+            ok = ok && bp_create_container(writer, BP_LIST);
+                ok = ok && bp_put_integer(writer, SCHEMA_FLOAT);
+            ok = ok && bp_finish_container(writer);
+
+            ok = ok && bp_put_string(writer, "current_sampling_period");
+            ok = ok && bp_create_container(writer, BP_LIST);
+                ok = ok && bp_put_integer(writer, SCHEMA_INTEGER | SCHEMA_READ_ONLY);
+            ok = ok && bp_finish_container(writer);
+
+            ok = ok && bp_put_string(writer, "aggregation_window");
+            ok = ok && bp_create_container(writer, BP_LIST);
+                ok = ok && bp_put_integer(writer, SCHEMA_INTEGER | SCHEMA_MINIMUM);
+                ok = ok && bp_put_integer(writer, 0);
+            ok = ok && bp_finish_container(writer);
+
+            ok = ok && bp_put_string(writer, "wake_budget");
+            ok = ok && bp_create_container(writer, BP_LIST);
+                ok = ok && bp_put_integer(writer, SCHEMA_INTEGER | SCHEMA_MINIMUM);
+                ok = ok && bp_put_integer(writer, 0);
+            ok = ok && bp_finish_container(writer);
+
+            ok = ok && bp_put_string(writer, "upload_every");
+            ok = ok && bp_create_container(writer, BP_LIST);
+                ok = ok && bp_put_integer(writer, SCHEMA_INTEGER | SCHEMA_MINIMUM);
+                ok = ok && bp_put_integer(writer, 1);
+            ok = ok && bp_finish_container(writer);
+
             ok = ok && bp_put_string(writer, "queue");
             ok = ok && bp_create_container(writer, BP_LIST);
                 ok = ok && bp_put_integer(writer, SCHEMA_BOOLEAN);
@@ -130,6 +210,16 @@ static bool write_resource_schema(bp_pack_t *writer)
                 ok = ok && bp_put_integer(writer, SCHEMA_BOOLEAN);
             ok = ok && bp_finish_container(writer);
 
+            ok = ok && bp_put_string(writer, "derived_humidity");
+            ok = ok && bp_create_container(writer, BP_LIST);
+                ok = ok && bp_put_integer(writer, SCHEMA_BOOLEAN);
+            ok = ok && bp_finish_container(writer);
+
+            ok = ok && bp_put_string(writer, "derived_aqi");
+            ok = ok && bp_create_container(writer, BP_LIST);
+                ok = ok && bp_put_integer(writer, SCHEMA_BOOLEAN);
+            ok = ok && bp_finish_container(writer);
+
             ok = ok && bp_put_string(writer, "sleep");
             ok = ok && bp_create_container(writer, BP_LIST);
                 ok = ok && bp_put_integer(writer, SCHEMA_BOOLEAN);
@@ -181,10 +271,26 @@ uint32_t application_resource_handler(uint32_t method, bp_pack_t *reader, bp_pac
 
         ok = ok && bp_put_string(writer, "sampling_period");
         ok = ok && bp_put_integer(writer, application.sampling_period);
+        ok = ok && bp_put_string(writer, "max_sampling_period");
+        ok = ok && bp_put_integer(writer, application.max_sampling_period);
+        ok = ok && bp_put_string(writer, "adaptive_band");
+        ok = ok && bp_put_float(writer, application.adaptive_band);
+        ok = ok && bp_put_string(writer, "current_sampling_period");
+        ok = ok && bp_put_integer(writer, application_period ? application_period : application.sampling_period);
+        ok = ok && bp_put_string(writer, "aggregation_window");
+        ok = ok && bp_put_integer(writer, application.aggregation_window);
+        ok = ok && bp_put_string(writer, "wake_budget");
+        ok = ok && bp_put_integer(writer, application.wake_budget);
+        ok = ok && bp_put_string(writer, "upload_every");
+        ok = ok && bp_put_integer(writer, application.upload_every);
         ok = ok && bp_put_string(writer, "queue");
         ok = ok && bp_put_boolean(writer, application.queue);
         ok = ok && bp_put_string(writer, "diagnostics");
         ok = ok && bp_put_boolean(writer, application.diagnostics);
+        ok = ok && bp_put_string(writer, "derived_humidity");
+        ok = ok && bp_put_boolean(writer, application.derived_humidity);
+        ok = ok && bp_put_string(writer, "derived_aqi");
+        ok = ok && bp_put_boolean(writer, application.derived_aqi);
         ok = ok && bp_put_string(writer, "sleep");
         ok = ok && bp_put_boolean(writer, application.sleep);
 
@@ -200,11 +306,30 @@ uint32_t application_resource_handler(uint32_t method, bp_pack_t *reader, bp_pac
                 if(bp_match(reader, "sampling_period")) {
                     application.sampling_period = bp_get_integer(reader);
                     application.next_measurement_time = application.last_measurement_time + application.sampling_period * 1000000L;
+                    application_period = 0;
+                }
+                else if(bp_match(reader, "max_sampling_period")) {
+                    application.max_sampling_period = bp_get_integer(reader);
+                    application_period = 0;
                 }
+                else if(bp_match(reader, "adaptive_band"))
+                    application.adaptive_band = bp_get_float(reader);
+                else if(bp_match(reader, "aggregation_window")) {
+                    application.aggregation_window = bp_get_integer(reader);
+                    aggregates_init();
+                }
+                else if(bp_match(reader, "wake_budget"))
+                    application.wake_budget = bp_get_integer(reader);
+                else if(bp_match(reader, "upload_every"))
+                    application.upload_every = bp_get_integer(reader);
                 else if(bp_match(reader, "queue"))
                     application.queue = bp_get_boolean(reader);
                 else if(bp_match(reader, "diagnostics"))
                     application.diagnostics = bp_get_boolean(reader);
+                else if(bp_match(reader, "derived_humidity"))
+                    application.derived_humidity = bp_get_boolean(reader);
+                else if(bp_match(reader, "derived_aqi"))
+                    application.derived_aqi = bp_get_boolean(reader);
                 else if(bp_match(reader, "sleep"))
                     application.sleep = bp_get_boolean(reader);
                 else bp_next(reader);
@@ -221,11 +346,69 @@ uint32_t application_resource_handler(uint32_t method, bp_pack_t *reader, bp_pac
     return response;
 }
 
+// microseconds left before a sleeping node has to go back to sleep
+int64_t application_time_left()
+{
+    if(!application.sleep || !application.wake_budget)
+        return INT64_MAX;
+    return application.deadline - esp_timer_get_time();
+}
+
+// follows a device parameter for adaptive sampling, one call per measurement pass
+void application_track(devices_index_t device, device_parameter_t parameter, float value)
+{
+    uint8_t i;
+
+    if(!application.max_sampling_period)
+        return;
+    for(i = 0; i < application_series_count; i++)
+        if(application_series[i].device == device && application_series[i].parameter == parameter)
+            break;
+    if(i == application_series_count) {
+        if(application_series_count < APPLICATION_SERIES_NUM_MAX) {
+            application_series[i] = (application_series_t) { device, parameter, value, 0 };
+            application_series_count++;
+        }
+        application_stable = false;     // no history yet, or none kept as the table is full
+        return;
+    }
+
+    application_series_t *series = &application_series[i];
+    float band = application.adaptive_band * fmaxf(fabsf(series->mean), 1);
+    float deviation = value - series->mean;
+    series->mean += deviation / 4;
+    series->variance += (deviation * deviation - series->variance) / 4;
+    if(fabsf(deviation) > band)
+        application_jumped = true;
+    else if(sqrtf(series->variance) > band / 2)
+        application_stable = false;
+}
+
+// sets the next measurement time after a pass, doubling the period while stable and back to the base one on a jump
+void application_adapt()
+{
+    uint32_t period = application_period ? application_period : application.sampling_period;
+
+    if(application.max_sampling_period <= application.sampling_period || application_jumped)
+        period = application.sampling_period;
+    else if(application_stable && application_series_count)
+        period = period * 2 < application.max_sampling_period ? period * 2 : application.max_sampling_period;
+
+    if(period != application_period)
+        ESP_LOGI(__func__, "sampling period: %lu s", period);
+    application_period = period;
+    application.next_measurement_time += ((int64_t) period - application.sampling_period) * 1000000LL;
+    application_jumped = false;
+    application_stable = true;
+}
+
 void application_measure()
 {
     if(application.diagnostics) {
-        measurements_append(board.id, RESOURCE_APPLICATION, 0, 0, 0, 0, 0, 0, METRIC_UpTime, NOW, UNIT_s, esp_timer_get_time() / 1000000L);
-        measurements_append(board.id, RESOURCE_APPLICATION, 0, 0, 0, 0, 0, 0, METRIC_MinimumFreeHeap, NOW, UNIT_B, esp_get_minimum_free_heap_size());
+        measurements_append(board.id, RESOURCE_APPLICATION, 0, 0, 0, 0, 0, 0, METRIC_UpTime, NOW_MS, UNIT_s, esp_timer_get_time() / 1000000L);
+        measurements_append(board.id, RESOURCE_APPLICATION, 0, 0, 0, 0, 0, 0, METRIC_MinimumFreeHeap, NOW_MS, UNIT_B, esp_get_minimum_free_heap_size());
+        if(application_awake_time)
+            measurements_append(board.id, RESOURCE_APPLICATION, 0, 0, 0, 0, 0, 0, METRIC_AwakeTime, NOW_MS, UNIT_s, application_awake_time / 1000000.0);
     }
 }
 
@@ -8,23 +8,47 @@
 #define APP_NAME       "SensorWatcher"
 #define APP_VERSION    0x000C
 
+#define APPLICATION_SERIES_NUM_MAX	8	// device parameters tracked for adaptive sampling, the period is not stretched with more
+
 #include "bigpacks.h"
+#include "devices.h"
+
+typedef struct {					// kept in RTC memory, 12 bytes
+	devices_index_t device;
+	device_parameter_t parameter;
+	float mean;						// exponentially weighted
+	float variance;
+} application_series_t;
 
 typedef struct {
 	int64_t last_measurement_time;
 	int64_t next_measurement_time;
+	int64_t deadline;				// esp_timer time by which a sleeping node must be asleep again
 	uint32_t sampling_period;
+	uint32_t max_sampling_period;	// adaptive sampling lengthens the period up to this, 0 to disable
+	float adaptive_band;			// relative to the mean, series within it are stable and jumps beyond it reset the period
+	uint32_t aggregation_window;	// seconds of samples summarized in a single set of rows, 0 to send every sample
+	uint32_t wake_budget;			// milliseconds from the start of a measurement cycle, 0 for unbounded
+	uint16_t upload_every;			// wakes per upload of a sleeping node
+	bool upload;					// this wake brings up WiFi and the backends
 	bool sleep;
 	bool diagnostics;
+	bool derived_humidity;			// dew point, absolute humidity and heat index of devices with temperature and humidity
+	bool derived_aqi;				// rolling 24 h PM2.5 AQI of devices with PM2.5
 	bool queue;
 } application_t;
 
 extern application_t application;
+extern int64_t application_awake_time;
+extern uint32_t application_period;
 
 void application_init();
 bool application_read_from_nvs();
 bool application_write_to_nvs();
 bool application_verify_license();
+int64_t application_time_left();
+void application_track(devices_index_t device, device_parameter_t parameter, float value);
+void application_adapt();
 void application_measure();
 bool application_schema_handler(char *resource_name, bp_pack_t *writer);
 uint32_t application_resource_handler(uint32_t method, bp_pack_t *reader, bp_pack_t *writer);
@@ -1,9 +1,11 @@
 // Copyright (c) 2024 José Francisco Castro <me@fran.cc>
 // SPDX-License-Identifier: GPL-3.0-or-later
 
+#include <stdlib.h>
 #include <string.h>
 
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <nvs_flash.h>
 #include <esp_crt_bundle.h>
 #include <mqtt_client.h>
@@ -12,11 +14,14 @@
 #include "enums.h"
 #include "application.h"
 #include "backends.h"
+#include "devices.h"
+#include "measurements.h"
 #include "schema.h"
 
 backend_t backends[BACKENDS_NUM_MAX];
 bool backends_started;
 uint8_t backends_modified;
+uint32_t backends_epoch = 0;
 
 void backends_init()
 {
@@ -99,6 +104,23 @@ bool backends_read_from_nvs()
             snprintf(nvs_key, sizeof(nvs_key), "%u_tmpl_footer", i % 255);
             length = BACKEND_TEMPLATE_FOOTER_LENGTH;
             ok = ok && !nvs_get_str(handle, nvs_key, backends[i].template_footer, &length);
+
+            snprintf(nvs_key, sizeof(nvs_key), "%u_filter", i % 255);    // missing before filters were added
+            length = BACKEND_FILTER_LENGTH;
+            if(nvs_get_str(handle, nvs_key, backends[i].filter, &length))
+                backends[i].filter[0] = 0;
+            if(!backends_compile_filter(i))
+                ESP_LOGE(__func__, "invalid filter at backend %u, sending no rows", i);
+
+            snprintf(nvs_key, sizeof(nvs_key), "%u_qos", i % 255);      // missing before QoS was selectable
+            if(nvs_get_u8(handle, nvs_key, &(backends[i].qos)) || backends[i].qos > BACKEND_MQTT_QOS_MAX)
+                backends[i].qos = 0;
+
+            snprintf(nvs_key, sizeof(nvs_key), "%u_per_series", i % 255);
+            nvs_get_u8(handle, nvs_key, (uint8_t *) &(backends[i].topic_per_series));
+
+            snprintf(nvs_key, sizeof(nvs_key), "%u_tls_resume", i % 255);
+            nvs_get_u8(handle, nvs_key, (uint8_t *) &(backends[i].tls_resumption));
         }
 
         if(!ok)
@@ -156,6 +178,14 @@ bool backends_write_to_nvs()
             ok = ok && !nvs_set_str(handle, nvs_key, backends[i].template_path_separator);
             snprintf(nvs_key, sizeof(nvs_key), "%u_tmpl_footer", i % 255);
             ok = ok && !nvs_set_str(handle, nvs_key, backends[i].template_footer);
+            snprintf(nvs_key, sizeof(nvs_key), "%u_filter", i % 255);
+            ok = ok && !nvs_set_str(handle, nvs_key, backends[i].filter);
+            snprintf(nvs_key, sizeof(nvs_key), "%u_qos", i % 255);
+            ok = ok && !nvs_set_u8(handle, nvs_key, backends[i].qos);
+            snprintf(nvs_key, sizeof(nvs_key), "%u_per_series", i % 255);
+            ok = ok && !nvs_set_u8(handle, nvs_key, backends[i].topic_per_series);
+            snprintf(nvs_key, sizeof(nvs_key), "%u_tls_resume", i % 255);
+            ok = ok && !nvs_set_u8(handle, nvs_key, backends[i].tls_resumption);
         }
         ok = ok && !nvs_commit(handle);
         nvs_close(handle);
@@ -207,6 +237,36 @@ static bool write_item_schema(bp_pack_t *writer)
                 ok = ok && bp_put_integer(writer, BACKEND_MESSAGE_LENGTH);
             ok = ok && bp_finish_container(writer);
 
+            ok = ok && bp_put_string(writer, "outbox_count");
+            ok = ok && bp_create_container(writer, BP_LIST);
+                ok = ok && bp_put_integer(writer, SCHEMA_INTEGER | SCHEMA_READ_ONLY);
+            ok = ok && bp_finish_container(writer);
+
+            ok = ok && bp_put_string(writer, "outbox_length");
+            ok = ok && bp_create_container(writer, BP_LIST);
+                ok = ok && bp_put_integer(writer, SCHEMA_INTEGER | SCHEMA_READ_ONLY);
+            ok = ok && bp_finish_container(writer);
+
+            ok = ok && bp_put_string(writer, "retries");
+            ok = ok && bp_create_container(writer, BP_LIST);
+                ok = ok && bp_put_integer(writer, SCHEMA_INTEGER | SCHEMA_READ_ONLY);
+            ok = ok && bp_finish_container(writer);
+
+            ok = ok && bp_put_string(writer, "dropped");
+            ok = ok && bp_create_container(writer, BP_LIST);
+                ok = ok && bp_put_integer(writer, SCHEMA_INTEGER | SCHEMA_READ_ONLY);
+            ok = ok && bp_finish_container(writer);
+
+            ok = ok && bp_put_string(writer, "published");
+            ok = ok && bp_create_container(writer, BP_LIST);
+                ok = ok && bp_put_integer(writer, SCHEMA_INTEGER | SCHEMA_READ_ONLY);
+            ok = ok && bp_finish_container(writer);
+
+            ok = ok && bp_put_string(writer, "in_flight");
+            ok = ok && bp_create_container(writer, BP_LIST);
+                ok = ok && bp_put_integer(writer, SCHEMA_INTEGER | SCHEMA_READ_ONLY);
+            ok = ok && bp_finish_container(writer);
+
             ok = ok && bp_put_string(writer, "service");
             ok = ok && bp_create_container(writer, BP_LIST);
                 ok = ok && bp_put_integer(writer, SCHEMA_STRING | SCHEMA_MAXIMUM_BYTES);
@@ -309,6 +369,29 @@ static bool write_item_schema(bp_pack_t *writer)
                 ok = ok && bp_put_integer(writer, BACKEND_TEMPLATE_FOOTER_LENGTH);
             ok = ok && bp_finish_container(writer);
 
+            ok = ok && bp_put_string(writer, "filter");
+            ok = ok && bp_create_container(writer, BP_LIST);
+                ok = ok && bp_put_integer(writer, SCHEMA_STRING | SCHEMA_MAXIMUM_BYTES);
+                ok = ok && bp_put_integer(writer, BACKEND_FILTER_LENGTH);
+            ok = ok && bp_finish_container(writer);
+
+            ok = ok && bp_put_string(writer, "qos");
+            ok = ok && bp_create_container(writer, BP_LIST);
+                ok = ok && bp_put_integer(writer, SCHEMA_INTEGER | SCHEMA_MINIMUM | SCHEMA_MAXIMUM);
+                ok = ok && bp_put_integer(writer, 0);
+                ok = ok && bp_put_integer(writer, BACKEND_MQTT_QOS_MAX);
+            ok = ok && bp_finish_container(writer);
+
+            ok = ok && bp_put_string(writer, "topic_per_series");
+            ok = ok && bp_create_container(writer, BP_LIST);
+                ok = ok && bp_put_integer(writer, SCHEMA_BOOLEAN);
+            ok = ok && bp_finish_container(writer);
+
+            ok = ok && bp_put_string(writer, "tls_resumption");
+            ok = ok && bp_create_container(writer, BP_LIST);
+                ok = ok && bp_put_integer(writer, SCHEMA_BOOLEAN);
+            ok = ok && bp_finish_container(writer);
+
         ok = ok && bp_finish_container(writer);
     ok = ok && bp_finish_container(writer);
     return ok;
@@ -393,6 +476,12 @@ bool backend_pack(bp_pack_t *writer, uint32_t index)
     ok = ok && bp_put_string(writer, "status") && bp_put_string(writer, backend_status_labels[backends[index].status]);
     ok = ok && bp_put_string(writer, "error") && bp_put_integer(writer, backends[index].error);
     ok = ok && bp_put_string(writer, "message") && bp_put_string(writer, backends[index].message);
+    ok = ok && bp_put_string(writer, "outbox_count") && bp_put_integer(writer, backends[index].outbox_count);
+    ok = ok && bp_put_string(writer, "outbox_length") && bp_put_integer(writer, backends[index].outbox_length);
+    ok = ok && bp_put_string(writer, "retries") && bp_put_integer(writer, backends[index].retries);
+    ok = ok && bp_put_string(writer, "dropped") && bp_put_integer(writer, backends[index].dropped);
+    ok = ok && bp_put_string(writer, "published") && bp_put_integer(writer, backends[index].published);
+    ok = ok && bp_put_string(writer, "in_flight") && bp_put_integer(writer, backends_in_flight(index));
 
     ok = ok && bp_put_string(writer, "service") && bp_put_string(writer, backends[index].service);
     ok = ok && bp_put_string(writer, "uri") && bp_put_string(writer, backends[index].uri);
@@ -410,6 +499,10 @@ bool backend_pack(bp_pack_t *writer, uint32_t index)
     ok = ok && bp_put_string(writer, "template_row_separator") && bp_put_string(writer, backends[index].template_row_separator);
     ok = ok && bp_put_string(writer, "template_path_separator") && bp_put_string(writer, backends[index].template_path_separator);
     ok = ok && bp_put_string(writer, "template_footer") && bp_put_string(writer, backends[index].template_footer);
+    ok = ok && bp_put_string(writer, "filter") && bp_put_string(writer, backends[index].filter);
+    ok = ok && bp_put_string(writer, "qos") && bp_put_integer(writer, backends[index].qos);
+    ok = ok && bp_put_string(writer, "topic_per_series") && bp_put_boolean(writer, backends[index].topic_per_series);
+    ok = ok && bp_put_string(writer, "tls_resumption") && bp_put_boolean(writer, backends[index].tls_resumption);
     ok = ok && bp_finish_container(writer);
 
     return ok;
@@ -469,6 +562,19 @@ bool backend_unpack(bp_pack_t *reader, uint32_t index)
             ok = ok && bp_get_string(reader, backends[index].template_path_separator, BACKEND_TEMPLATE_SEPARATOR_LENGTH / sizeof(bp_type_t)) != BP_INVALID_LENGTH;
         else if(bp_match(reader, "template_footer"))
             ok = ok && bp_get_string(reader, backends[index].template_footer, BACKEND_TEMPLATE_FOOTER_LENGTH / sizeof(bp_type_t)) != BP_INVALID_LENGTH;
+        else if(bp_match(reader, "filter")) {
+            ok = ok && bp_get_string(reader, backends[index].filter, BACKEND_FILTER_LENGTH / sizeof(bp_type_t)) != BP_INVALID_LENGTH;
+            ok = ok && backends_compile_filter(index);
+        }
+        else if(bp_match(reader, "qos")) {
+            int32_t qos = bp_get_integer(reader);
+            ok = ok && qos >= 0 && qos <= BACKEND_MQTT_QOS_MAX;
+            backends[index].qos = ok ? qos : 0;
+        }
+        else if(bp_match(reader, "topic_per_series"))
+            backends[index].topic_per_series = bp_get_boolean(reader);
+        else if(bp_match(reader, "tls_resumption"))
+            backends[index].tls_resumption = bp_get_boolean(reader);
         else bp_next(reader);
     }
     bp_close(reader);
@@ -476,6 +582,20 @@ bool backend_unpack(bp_pack_t *reader, uint32_t index)
     return ok;
 }
 
+// moves the cursor of the delivered messages from the MQTT task, unless they were given up already
+static void backends_acknowledge(backend_t *backend)
+{
+    unsigned delivered = backend->delivered;
+    while(delivered != backend->published && !atomic_compare_exchange_weak(&backend->delivered, &delivered, delivered + 1));
+}
+
+// counts the messages in flight as delivered, returns how many were not acknowledged
+static uint32_t backends_give_up(uint8_t index)
+{
+    unsigned published = backends[index].published;
+    return published - atomic_exchange(&backends[index].delivered, published);
+}
+
 void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_t event_id, void *event_data)
 {
     backend_t *backend = handler_args;
@@ -484,12 +604,20 @@ void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_t event
     switch ((esp_mqtt_event_id_t)event_id) {
     case MQTT_EVENT_CONNECTED:
         break;
-    case MQTT_EVENT_DISCONNECTED:
+    case MQTT_EVENT_DISCONNECTED:     // the outbox keeps the unacknowledged messages until the reconnection
         if(backend->status == BACKEND_STATUS_ONLINE) {
             backend->status = BACKEND_STATUS_OFFLINE;
             backend->error = 0;
         }
         break;
+    case MQTT_EVENT_PUBLISHED:        // PUBACK or PUBCOMP, only for a QoS above 0
+        backends_acknowledge(backend);
+        break;
+    case MQTT_EVENT_DELETED:          // expired in the outbox before being sent or acknowledged
+        if(backend->qos)
+            backends_acknowledge(backend);
+        backend->dropped++;
+        break;
     // case MQTT_EVENT_DATA:
     //     printf("TOPIC=%.*s\r\n", event->topic_len, event->topic);
     //     printf("DATA=%.*s\r\n", event->data_len, event->data);   /// send this to postman
@@ -549,6 +677,7 @@ void backends_start()
                 if(backends[i].handle) {
                     esp_mqtt_client_destroy(backends[i].handle);
                     backends[i].handle = NULL;
+                    backends[i].dropped += backends_give_up(i);
                 }
                 esp_err_t err = ESP_OK;
                 err = err ? err : ((backends[i].handle = esp_mqtt_client_init(&mqtt_cfg)) ? ESP_OK : ESP_ERR_INVALID_ARG); /// this crash the micro if uri contains an *
@@ -564,11 +693,14 @@ void backends_start()
 
 void backends_stop()
 {
+    backends_epoch++;       // upload workers drop their HTTP connections on the next job
+
     if(backends_started) {
         for(int i = 0; i != BACKENDS_NUM_MAX; i++)
             if(backends[i].uri[0] == 'm' && backends[i].handle) {
                 esp_mqtt_client_destroy(backends[i].handle);
                 backends[i].handle = NULL;
+                backends[i].dropped += backends_give_up(i);     // lost with the outbox
                 backends[i].status = BACKEND_STATUS_OFFLINE;
                 backends[i].error = 0;
             }
@@ -584,3 +716,111 @@ void backends_clear_status()
         backends[i].message[0] = 0;
     }
 }
+
+// messages published with a QoS above 0 and not acknowledged yet
+uint32_t backends_in_flight(uint8_t index)
+{
+    return backends[index].published - backends[index].delivered;
+}
+
+// whether deep sleep would lose messages waiting in the outbox of an MQTT client,
+// the ones not acknowledged within BACKEND_MQTT_ACK_TIMEOUT of the last enqueue are given up
+bool backends_busy()
+{
+    bool busy = false;
+    for(int i = 0; i != BACKENDS_NUM_MAX; i++)
+        if(backends[i].handle && backends_in_flight(i)) {
+            if(esp_timer_get_time() - backends[i].published_time < BACKEND_MQTT_ACK_TIMEOUT * 1000000LL)
+                busy = true;
+            else {
+                ESP_LOGE(__func__, "%lu messages to backend %i not acknowledged", backends_in_flight(i), i);
+                backends[i].dropped += backends_give_up(i);
+            }
+        }
+    return busy;
+}
+
+bool backends_share_encoding(uint8_t a, uint8_t b)
+{
+    if(backends[a].format != backends[b].format || strcmp(backends[a].filter, backends[b].filter))
+        return false;
+
+    if(backends[a].format == BACKEND_FORMAT_TEMPLATE)
+        return !strcmp(backends[a].template_header, backends[b].template_header) &&
+               !strcmp(backends[a].template_row, backends[b].template_row) &&
+               !strcmp(backends[a].template_row_separator, backends[b].template_row_separator) &&
+               !strcmp(backends[a].template_path_separator, backends[b].template_path_separator) &&
+               !strcmp(backends[a].template_footer, backends[b].template_footer);
+
+    return true;    // postman signatures are added per backend after encoding
+}
+
+static int find_label(const char *labels[], int count, const char *label)
+{
+    int i;
+    for(i = 0; i < count && (!labels[i] || strcmp(labels[i], label)); i++);
+    return i;
+}
+
+// Terms are separated by commas or spaces and look like field:value, with a leading ! to exclude the
+// rows they match. Fields are resource, part and metric (labels), node (hex) and path (prefix).
+// A row is sent if it matches no excluding term and any including term, or there are none.
+bool backends_compile_filter(uint8_t index)
+{
+    bool ok = true;
+    char text[BACKEND_FILTER_LENGTH];
+    char *state;
+    backend_t *backend = &backends[index];
+
+    strlcpy(text, backend->filter, sizeof(text));
+    backend->filters_count = 0;
+    for(char *term = strtok_r(text, ", ", &state); term && ok; term = strtok_r(NULL, ", ", &state)) {
+        backend_filter_t *filter = &backend->filters[backend->filters_count];
+        char *value = strchr(term, ':');
+        ok = ok && backend->filters_count < BACKEND_FILTERS_NUM_MAX && value;
+        if(!ok)
+            break;
+        memset(filter, 0, sizeof(backend_filter_t));
+        filter->exclude = term[0] == '!';
+        term += filter->exclude;
+        *value++ = 0;
+
+        if(!strcmp(term, "resource")) {
+            int i = find_label(resource_labels, RESOURCE_NUM_MAX, value);
+            filter->mask = measurements_build_descriptor(0, 0x3F, 0, 0, 0, 0, 0, 0, 0);
+            filter->value = measurements_build_descriptor(0, i, 0, 0, 0, 0, 0, 0, 0);
+            ok = ok && i < RESOURCE_NUM_MAX;
+        }
+        else if(!strcmp(term, "part")) {
+            int i;
+            for(i = 0; i < PART_NUM_MAX && (!parts[i].label || strcmp(parts[i].label, value)); i++);
+            filter->mask = measurements_build_descriptor(0, 0, 0, 0, 0, 0x0FFF, 0, 0, 0);
+            filter->value = measurements_build_descriptor(0, 0, 0, 0, 0, i, 0, 0, 0);
+            ok = ok && i < PART_NUM_MAX;
+        }
+        else if(!strcmp(term, "metric")) {
+            int i = find_label(metric_labels, METRIC_NUM_MAX, value);
+            filter->mask = measurements_build_descriptor(0, 0, 0, 0, 0, 0, 0, 0x0FFF, 0);
+            filter->value = measurements_build_descriptor(0, 0, 0, 0, 0, 0, 0, i, 0);
+            ok = ok && i < METRIC_NUM_MAX;
+        }
+        else if(!strcmp(term, "node")) {
+            char *end;
+            filter->node = strtoull(value, &end, 16);
+            ok = ok && !*end && filter->node;
+        }
+        else if(!strcmp(term, "path"))
+            ok = ok && strlcpy(filter->path, value, sizeof(filter->path)) < sizeof(filter->path);
+        else
+            ok = false;
+
+        if(ok)
+            backend->filters_count++;
+    }
+    if(!ok) {       // a single term excluding every row, a mistyped filter must not leak what it was meant to hold back
+        memset(&backend->filters[0], 0, sizeof(backend_filter_t));
+        backend->filters[0].exclude = true;
+        backend->filters_count = 1;
+    }
+    return ok;
+}
@@ -15,6 +15,13 @@
 #define BACKEND_TOPIC_LENGTH		256
 #define BACKEND_MESSAGE_LENGTH		256
 #define BACKEND_CONTENT_TYPE_LENGTH	64
+#define BACKEND_FILTER_LENGTH		128
+#define BACKEND_FILTERS_NUM_MAX		8
+#define BACKEND_FILTER_PATH_LENGTH	32
+#define BACKEND_MQTT_QOS_MAX		2
+#define BACKEND_MQTT_WINDOW			4		// MQTT messages awaiting their acknowledgement, each one a payload in the outbox
+#define BACKEND_MQTT_SERIES_WINDOW	64		// the same with a message per series, each one a single row
+#define BACKEND_MQTT_ACK_TIMEOUT	5		// seconds after the last enqueue before the unacknowledged messages are given up
 
 #define BACKEND_TEMPLATE_HEADER_LENGTH			256
 #define BACKEND_TEMPLATE_ROW_LENGTH				256
@@ -26,8 +33,18 @@
 #define BACKEND_ERROR_MQTT_RETURN_CODE_BASE	0x30000000
 #define BACKEND_ERROR_HTTP_STATUS_BASE		0x40000000
 
+#include <stdatomic.h>
+
 #include "bigpacks.h"
 
+typedef struct {				// a term of the filter of a backend, compiled from its text
+	uint64_t mask;				// over the descriptor of a row, 0 to match any
+	uint64_t value;
+	uint64_t node;				// 0 to match any
+	char path[BACKEND_FILTER_PATH_LENGTH];	// prefix of the path with '_' separators, empty to match any
+	bool exclude;
+} backend_filter_t;
+
 typedef struct {
 	uint8_t auth;
 	uint8_t format;
@@ -46,17 +63,31 @@ typedef struct {
 	char template_row_separator[BACKEND_TEMPLATE_SEPARATOR_LENGTH];
 	char template_path_separator[BACKEND_TEMPLATE_SEPARATOR_LENGTH];
 	char template_footer[BACKEND_TEMPLATE_FOOTER_LENGTH];
+	char filter[BACKEND_FILTER_LENGTH];		// terms like "resource:wifi" or "!metric:RSSI", empty to send every row
+	uint8_t qos;				// of MQTT publishes, the ones above 0 are kept in the outbox until acknowledged
+	bool topic_per_series;		// MQTT rows are retained at <output_topic>/<path> instead of a payload at output_topic
+	bool tls_resumption;		// HTTPS requests go through esp_tls, resuming the session of the last wake
 
+	backend_filter_t filters[BACKEND_FILTERS_NUM_MAX];
+	uint8_t filters_count;
 	void *handle;
 	int32_t status;
 	int32_t error;
 	char message[BACKEND_MESSAGE_LENGTH];
+	uint32_t outbox_count;		// batches waiting to be retried
+	uint32_t outbox_length;
+	uint32_t retries;
+	atomic_uint dropped;		// batches rejected by the server or evicted from a full outbox
+	atomic_uint published;		// MQTT messages enqueued with a QoS above 0
+	atomic_uint delivered;		// cursor of the published ones acknowledged by the broker or expired in the outbox, moved by the MQTT task
+	int64_t published_time;		// esp_timer time of the last one
 } backend_t;
 
 
 extern backend_t backends[];
 extern bool backends_started;
 extern uint8_t backends_modified;
+extern uint32_t backends_epoch;
 
 void backends_init();
 bool backends_read_from_nvs();
@@ -64,6 +95,10 @@ bool backends_write_to_nvs();
 void backends_start();
 void backends_stop();
 void backends_clear_status();
+bool backends_share_encoding(uint8_t a, uint8_t b);
+bool backends_compile_filter(uint8_t index);
+uint32_t backends_in_flight(uint8_t index);
+bool backends_busy();
 bool backend_pack(bp_pack_t *writer, uint32_t index);
 bool backend_unpack(bp_pack_t *reader, uint32_t index);
 bool backends_schema_handler(char *resource_name, bp_pack_t *writer);
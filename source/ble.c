@@ -508,12 +508,12 @@ bool ble_stop_scan()
     return ble_gap_disc_cancel() == 0;
 }
 
-bool ble_measurements_update(node_address_t node, measurement_descriptor_t descriptor, device_address_t address, measurement_timestamp_t timestamp, measurement_value_t value)
+bool ble_measurements_update(node_address_t node, measurement_descriptor_t descriptor, device_address_t address, uint32_t timestamp, measurement_value_t value)
 {
     int i;
     for(i = 0; i < ble_measurements_count; i++) {
         if(ble_measurements[i].descriptor == descriptor && ble_measurements[i].address == address && ble_measurements[i].node == node) {
-            ble_measurements[i].timestamp = timestamp > 1680000000 ? timestamp : 0;
+            ble_measurements[i].timestamp = timestamp > NOW_VALID_MIN ? timestamp : 0;
             ble_measurements[i].value = value;
             return true;
         }
@@ -522,7 +522,7 @@ bool ble_measurements_update(node_address_t node, measurement_descriptor_t descr
         ble_measurements[ble_measurements_count].node = node;
         ble_measurements[ble_measurements_count].descriptor = descriptor;
         ble_measurements[ble_measurements_count].address = address;
-        ble_measurements[ble_measurements_count].timestamp = timestamp > 1680000000 ? timestamp : 0;
+        ble_measurements[ble_measurements_count].timestamp = timestamp > NOW_VALID_MIN ? timestamp : 0;
         ble_measurements[ble_measurements_count].value = value;
         ble_measurements_count += 1;
         return true;
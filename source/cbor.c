@@ -0,0 +1,86 @@
+// Copyright (c) 2024 José Francisco Castro <me@fran.cc>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <string.h>
+
+#include "cbor.h"
+
+bool cbor_put_head(pbuf_t *buf, uint8_t major, uint64_t argument)
+{
+    uint8_t head[9];
+    size_t length;
+
+    head[0] = major << 5;
+    if(argument < 24) {
+        head[0] |= argument;
+        length = 1;
+    }
+    else if(argument <= 0xFF) {
+        head[0] |= 24;
+        head[1] = argument;
+        length = 2;
+    }
+    else if(argument <= 0xFFFF) {
+        head[0] |= 25;
+        head[1] = argument >> 8;
+        head[2] = argument;
+        length = 3;
+    }
+    else if(argument <= 0xFFFFFFFF) {
+        head[0] |= 26;
+        for(int i = 0; i < 4; i++)
+            head[1 + i] = argument >> (24 - 8 * i);
+        length = 5;
+    }
+    else {
+        head[0] |= 27;
+        for(int i = 0; i < 8; i++)
+            head[1 + i] = argument >> (56 - 8 * i);
+        length = 9;
+    }
+    return pbuf_put(buf, (char *) head, length);
+}
+
+bool cbor_put_integer(pbuf_t *buf, int64_t value)
+{
+    return value < 0 ? cbor_put_head(buf, CBOR_NEGATIVE, -1 - value) : cbor_put_head(buf, CBOR_UNSIGNED, value);
+}
+
+bool cbor_put_float(pbuf_t *buf, float value)
+{
+    uint32_t bits;
+    uint8_t bytes[5];
+
+    memcpy(&bits, &value, sizeof(bits));
+    bytes[0] = CBOR_SIMPLE << 5 | 26;
+    for(int i = 0; i < 4; i++)
+        bytes[1 + i] = bits >> (24 - 8 * i);
+    return pbuf_put(buf, (char *) bytes, sizeof(bytes));
+}
+
+bool cbor_put_double(pbuf_t *buf, double value)
+{
+    uint64_t bits;
+    uint8_t bytes[9];
+
+    memcpy(&bits, &value, sizeof(bits));
+    bytes[0] = CBOR_SIMPLE << 5 | 27;
+    for(int i = 0; i < 8; i++)
+        bytes[1 + i] = bits >> (56 - 8 * i);
+    return pbuf_put(buf, (char *) bytes, sizeof(bytes));
+}
+
+bool cbor_put_text(pbuf_t *buf, const char *text, size_t length)
+{
+    return cbor_put_head(buf, CBOR_TEXT, length) && pbuf_put(buf, text, length);
+}
+
+bool cbor_put_array(pbuf_t *buf, size_t count)
+{
+    return cbor_put_head(buf, CBOR_ARRAY, count);
+}
+
+bool cbor_put_map(pbuf_t *buf, size_t count)
+{
+    return cbor_put_head(buf, CBOR_MAP, count);
+}
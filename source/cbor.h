@@ -0,0 +1,29 @@
+// Copyright (c) 2024 José Francisco Castro <me@fran.cc>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef cbor_h
+#define cbor_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "pbuf.h"
+
+#define CBOR_UNSIGNED   0
+#define CBOR_NEGATIVE   1
+#define CBOR_BYTES      2
+#define CBOR_TEXT       3
+#define CBOR_ARRAY      4
+#define CBOR_MAP        5
+#define CBOR_SIMPLE     7
+
+bool cbor_put_head(pbuf_t *buf, uint8_t major, uint64_t argument);
+bool cbor_put_integer(pbuf_t *buf, int64_t value);
+bool cbor_put_float(pbuf_t *buf, float value);
+bool cbor_put_double(pbuf_t *buf, double value);
+bool cbor_put_text(pbuf_t *buf, const char *text, size_t length);
+bool cbor_put_array(pbuf_t *buf, size_t count);
+bool cbor_put_map(pbuf_t *buf, size_t count);
+
+#endif
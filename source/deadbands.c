@@ -0,0 +1,260 @@
+// Copyright (c) 2024 José Francisco Castro <me@fran.cc>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <math.h>
+#include <string.h>
+
+#include <esp_log.h>
+#include <nvs_flash.h>
+
+#include "alarms.h"
+#include "application.h"
+#include "deadbands.h"
+#include "now.h"
+#include "postman.h"
+#include "schema.h"
+
+deadband_t deadbands[DEADBANDS_NUM_MAX];
+RTC_DATA_ATTR deadband_state_t deadbands_state[DEADBANDS_NUM_MAX] = {{0}};
+
+void deadbands_init()
+{
+    memset(deadbands, 0, sizeof(deadbands));
+    deadbands_read_from_nvs();
+}
+
+bool deadbands_read_from_nvs()
+{
+    esp_err_t err;
+    nvs_handle_t handle;
+    char nvs_key[16];
+    size_t length;
+
+    err = nvs_open("deadbands", NVS_READWRITE, &handle);
+    if(err == ESP_OK) {
+        for(uint8_t i = 0; i < DEADBANDS_NUM_MAX; i++) {
+            bool ok = true;
+            snprintf(nvs_key, sizeof(nvs_key), "%u_device", i);
+            ok = ok && !nvs_get_u8(handle, nvs_key, &(deadbands[i].device));
+            snprintf(nvs_key, sizeof(nvs_key), "%u_parameter", i);
+            ok = ok && !nvs_get_u8(handle, nvs_key, &(deadbands[i].parameter));
+            snprintf(nvs_key, sizeof(nvs_key), "%u_deadband", i);
+            length = sizeof(deadbands[i].deadband);
+            ok = ok && !nvs_get_blob(handle, nvs_key, &(deadbands[i].deadband), &length);
+            snprintf(nvs_key, sizeof(nvs_key), "%u_silence", i);
+            ok = ok && !nvs_get_u32(handle, nvs_key, &(deadbands[i].max_silence));
+            if(!ok)
+                memset(&deadbands[i], 0, sizeof(deadband_t));
+        }
+        nvs_close(handle);
+        ESP_LOGI(__func__, "done");
+        return true;
+    }
+    else {
+        ESP_LOGI(__func__, "nvs_open failed");
+        return false;
+    }
+}
+
+bool deadbands_write_to_nvs()
+{
+    esp_err_t err;
+    bool ok = true;
+    nvs_handle_t handle;
+    char nvs_key[16];
+
+    err = nvs_open("deadbands", NVS_READWRITE, &handle);
+    if(err == ESP_OK) {
+        for(uint8_t i = 0; i < DEADBANDS_NUM_MAX && ok; i++) {
+            snprintf(nvs_key, sizeof(nvs_key), "%u_device", i);
+            ok = ok && !nvs_set_u8(handle, nvs_key, deadbands[i].device);
+            snprintf(nvs_key, sizeof(nvs_key), "%u_parameter", i);
+            ok = ok && !nvs_set_u8(handle, nvs_key, deadbands[i].parameter);
+            snprintf(nvs_key, sizeof(nvs_key), "%u_deadband", i);
+            ok = ok && !nvs_set_blob(handle, nvs_key, &(deadbands[i].deadband), sizeof(deadbands[i].deadband));
+            snprintf(nvs_key, sizeof(nvs_key), "%u_silence", i);
+            ok = ok && !nvs_set_u32(handle, nvs_key, deadbands[i].max_silence);
+        }
+        ok = ok && !nvs_commit(handle);
+        nvs_close(handle);
+        ESP_LOGI(__func__, "%s", ok ? "done" : "failed");
+        return ok;
+    }
+    else {
+        ESP_LOGI(__func__, "nvs_open failed");
+        return false;
+    }
+}
+
+// whether a value of a device parameter goes into the ring, one call per measurement pass,
+// values crossing the threshold of an alarm are always reported for the alarm to see them
+bool deadbands_report(devices_index_t device, device_parameter_t parameter, measurement_metric_t metric, float value)
+{
+    uint32_t period = application_period ? application_period : application.sampling_period;
+
+    if(application.aggregation_window && !application.sleep)
+        return true;    // windows fold every sample, their count and mean would miss the suppressed ones
+
+    for(uint8_t i = 0; i < DEADBANDS_NUM_MAX; i++) {
+        if(deadbands[i].deadband <= 0 || deadbands[i].device != device || deadbands[i].parameter != parameter)
+            continue;
+        deadband_state_t *state = &deadbands_state[i];
+        uint32_t now = NOW;     // a max_silence cannot be timed without a clock, values are reported until it is set
+        if(state->reported && fabsf(value - state->value) <= deadbands[i].deadband &&
+          !alarms_crossed(metric, state->value, value) &&
+          (!deadbands[i].max_silence || (now && state->last_report && now - state->last_report + period / 2 < deadbands[i].max_silence)))
+            return false;
+        state->value = value;
+        state->last_report = now;
+        state->reported = true;
+        return true;
+    }
+    return true;
+}
+
+static bool write_resource_schema(bp_pack_t *writer)
+{
+    bool ok = true;
+    ok = ok && bp_create_container(writer, BP_LIST);
+        ok = ok && bp_put_integer(writer, SCHEMA_LIST | SCHEMA_INDEX | SCHEMA_READ_ONLY);
+        ok = ok && bp_create_container(writer, BP_LIST);
+            ok = ok && bp_put_integer(writer, SCHEMA_INTEGER | SCHEMA_IDENTIFIER);
+        ok = ok && bp_finish_container(writer);
+    ok = ok && bp_finish_container(writer);
+    return ok;
+}
+
+static bool write_item_schema(bp_pack_t *writer)
+{
+    bool ok = true;
+    ok = ok && bp_create_container(writer, BP_LIST);
+        ok = ok && bp_put_integer(writer, SCHEMA_MAP);
+        ok = ok && bp_create_container(writer, BP_MAP);
+
+            ok = ok && bp_put_string(writer, "device");
+            ok = ok && bp_create_container(writer, BP_LIST);
+                ok = ok && bp_put_integer(writer, SCHEMA_INTEGER | SCHEMA_MINIMUM | SCHEMA_MAXIMUM);
+                ok = ok && bp_put_integer(writer, 0);
+                ok = ok && bp_put_integer(writer, DEVICES_NUM_MAX - 1);
+            ok = ok && bp_finish_container(writer);
+
+            ok = ok && bp_put_string(writer, "parameter");
+            ok = ok && bp_create_container(writer, BP_LIST);
+                ok = ok && bp_put_integer(writer, SCHEMA_INTEGER | SCHEMA_MINIMUM | SCHEMA_MAXIMUM);
+                ok = ok && bp_put_integer(writer, 0);
+                ok = ok && bp_put_integer(writer, DEVICES_PARAMETERS_NUM_MAX - 1);
+            ok = ok && bp_finish_container(writer);
+
+            ok = ok && bp_put_string(writer, "deadband");
+            ok = ok && bp_create_container(writer, BP_LIST);
+                ok = ok && bp_put_integer(writer, SCHEMA_FLOAT);
+            ok = ok && bp_finish_container(writer);
+
+            ok = ok && bp_put_string(writer, "max_silence");
+            ok = ok && bp_create_container(writer, BP_LIST);
+                ok = ok && bp_put_integer(writer, SCHEMA_INTEGER | SCHEMA_MINIMUM);
+                ok = ok && bp_put_integer(writer, 0);
+            ok = ok && bp_finish_container(writer);
+
+            ok = ok && bp_put_string(writer, "last_value");
+            ok = ok && bp_create_container(writer, BP_LIST);
+                ok = ok && bp_put_integer(writer, SCHEMA_FLOAT | SCHEMA_NULL | SCHEMA_READ_ONLY);
+            ok = ok && bp_finish_container(writer);
+
+        ok = ok && bp_finish_container(writer);
+    ok = ok && bp_finish_container(writer);
+    return ok;
+}
+
+bool deadbands_schema_handler(char *resource_name, bp_pack_t *writer)
+{
+    bool ok = true;
+
+    // GET
+    ok = ok && bp_create_container(writer, BP_LIST);
+        ok = ok && bp_create_container(writer, BP_LIST);                                // Path
+            ok = ok && bp_put_string(writer, resource_name);
+        ok = ok && bp_finish_container(writer);
+        ok = ok && bp_put_integer(writer, SCHEMA_GET_RESPONSE);                         // Methods
+        ok = ok && write_resource_schema(writer);                                       // Schema
+    ok = ok && bp_finish_container(writer);
+
+    // GET item / PUT item
+    ok = ok && bp_create_container(writer, BP_LIST);
+        ok = ok && bp_create_container(writer, BP_LIST);                                // Path
+            ok = ok && bp_put_string(writer, resource_name);
+            ok = ok && bp_put_none(writer);
+        ok = ok && bp_finish_container(writer);
+        ok = ok && bp_put_integer(writer, SCHEMA_GET_RESPONSE | SCHEMA_PUT_REQUEST);    // Methods
+        ok = ok && write_item_schema(writer);                                           // Schema
+    ok = ok && bp_finish_container(writer);
+
+    return ok;
+}
+
+uint32_t deadbands_resource_handler(uint32_t method, bp_pack_t *reader, bp_pack_t *writer)
+{
+    bool ok = true;
+    uint32_t index;
+
+    if(method == PM_GET) {
+        if(bp_next(reader)) {
+            if(!bp_is_integer(reader) || (index = bp_get_integer(reader)) > DEADBANDS_NUM_MAX - 1)
+                return PM_400_Bad_Request;
+
+            ok = ok && bp_create_container(writer, BP_MAP);
+            ok = ok && bp_put_string(writer, "device") && bp_put_integer(writer, deadbands[index].device);
+            ok = ok && bp_put_string(writer, "parameter") && bp_put_integer(writer, deadbands[index].parameter);
+            ok = ok && bp_put_string(writer, "deadband") && bp_put_float(writer, deadbands[index].deadband);
+            ok = ok && bp_put_string(writer, "max_silence") && bp_put_integer(writer, deadbands[index].max_silence);
+            ok = ok && bp_put_string(writer, "last_value");
+            ok = ok && (deadbands_state[index].reported ? bp_put_float(writer, deadbands_state[index].value) : bp_put_none(writer));
+            ok = ok && bp_finish_container(writer);
+        }
+        else {
+            ok = ok && bp_create_container(writer, BP_LIST);
+            for(index = 0; index != DEADBANDS_NUM_MAX && ok; index++)
+                ok = ok && bp_put_integer(writer, index);
+            ok = ok && bp_finish_container(writer);
+        }
+        return ok ? PM_205_Content : PM_500_Internal_Server_Error;
+    }
+    else if(method == PM_PUT) {
+        if(!bp_next(reader) || !bp_is_integer(reader) || (index = bp_get_integer(reader)) > DEADBANDS_NUM_MAX - 1 ||
+           !bp_close(reader) || !bp_next(reader) || !bp_is_map(reader) || !bp_open(reader))
+            return PM_400_Bad_Request;
+
+        deadband_t deadband = {0};
+        bool ok = true;
+        while(bp_next(reader)) {
+            if(bp_match(reader, "device")) {        // checked before being narrowed to the field
+                bp_integer_t device = bp_get_integer(reader);
+                ok = ok && device >= 0 && device < DEVICES_NUM_MAX;
+                deadband.device = ok ? device : 0;
+            }
+            else if(bp_match(reader, "parameter")) {
+                bp_integer_t parameter = bp_get_integer(reader);
+                ok = ok && parameter >= 0 && parameter < DEVICES_PARAMETERS_NUM_MAX;
+                deadband.parameter = ok ? parameter : 0;
+            }
+            else if(bp_match(reader, "deadband"))
+                deadband.deadband = bp_get_float(reader);
+            else if(bp_match(reader, "max_silence")) {
+                bp_integer_t max_silence = bp_get_integer(reader);
+                ok = ok && max_silence >= 0;
+                deadband.max_silence = ok ? max_silence : 0;
+            }
+            else bp_next(reader);
+        }
+        bp_close(reader);
+
+        if(!ok)
+            return PM_400_Bad_Request;
+
+        deadbands[index] = deadband;
+        memset(&deadbands_state[index], 0, sizeof(deadband_state_t));
+        return deadbands_write_to_nvs() ? PM_204_Changed : PM_500_Internal_Server_Error;
+    }
+    else
+        return PM_405_Method_Not_Allowed;
+}
@@ -0,0 +1,35 @@
+// Copyright (c) 2024 José Francisco Castro <me@fran.cc>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef deadbands_h
+#define deadbands_h
+
+#define DEADBANDS_NUM_MAX	16
+
+#include "bigpacks.h"
+#include "devices.h"
+#include "measurements.h"
+
+typedef struct {
+	devices_index_t device;
+	device_parameter_t parameter;
+	float deadband;				// a row is reported if it moved more than this from the last reported one
+	uint32_t max_silence;		// seconds, a row is reported anyway after this, 0 for never
+} deadband_t;					// not applied while aggregation windows are running
+
+typedef struct {				// kept in RTC memory, 12 bytes
+	float value;				// last reported
+	uint32_t last_report;		// wall clock seconds, 0 if the clock was not set then
+	bool reported;
+} deadband_state_t;
+
+extern deadband_t deadbands[];
+
+void deadbands_init();
+bool deadbands_read_from_nvs();
+bool deadbands_write_to_nvs();
+bool deadbands_report(devices_index_t device, device_parameter_t parameter, measurement_metric_t metric, float value);
+bool deadbands_schema_handler(char *resource_name, bp_pack_t *writer);
+uint32_t deadbands_resource_handler(uint32_t method, bp_pack_t *reader, bp_pack_t *writer);
+
+#endif
@@ -0,0 +1,175 @@
+// Copyright (c) 2024 José Francisco Castro <me@fran.cc>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <math.h>
+#include <string.h>
+
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#include "application.h"
+#include "derived.h"
+#include "enums.h"
+#include "measurements.h"
+
+#define SEEN_TEMPERATURE	1
+#define SEEN_HUMIDITY		2
+#define SEEN_PM2o5			4
+
+derived_inputs_t derived_inputs[DEVICES_NUM_MAX];
+derived_aqi_t derived_aqi[DERIVED_AQI_NUM_MAX];
+
+static const float aqi_breakpoints[][4] = {		// PM2.5 24 h concentration low, high -> index low, high (EPA 2024)
+	{   0.0,   9.0,   0,  50 },
+	{   9.1,  35.4,  51, 100 },
+	{  35.5,  55.4, 101, 150 },
+	{  55.5, 125.4, 151, 200 },
+	{ 125.5, 225.4, 201, 300 },
+	{ 225.5, 325.4, 301, 500 },
+};
+
+void derived_init()
+{
+    memset(derived_inputs, 0, sizeof(derived_inputs));
+    memset(derived_aqi, 0, sizeof(derived_aqi));
+}
+
+void derived_note(devices_index_t device, measurement_metric_t metric, measurement_timestamp_t timestamp, float value)
+{
+    if(device >= DEVICES_NUM_MAX)
+        return;
+    derived_inputs_t *inputs = &derived_inputs[device];
+    switch(metric) {
+    case METRIC_Temperature:
+        inputs->temperature = value;
+        inputs->seen |= SEEN_TEMPERATURE;
+        break;
+    case METRIC_Humidity:
+        inputs->humidity = value;
+        inputs->seen |= SEEN_HUMIDITY;
+        break;
+    case METRIC_PM2o5:
+        inputs->pm2o5 = value;
+        inputs->seen |= SEEN_PM2o5;
+        break;
+    default:
+        return;
+    }
+    inputs->timestamp = timestamp;
+}
+
+// Magnus formula, Sonntag constants
+static float dew_point(float temperature, float humidity)
+{
+    float gamma = logf(humidity / 100) + 17.62 * temperature / (243.12 + temperature);
+    return 243.12 * gamma / (17.62 - gamma);
+}
+
+// g/m3
+static float absolute_humidity(float temperature, float humidity)
+{
+    return 6.112 * expf(17.67 * temperature / (temperature + 243.5)) * humidity * 2.1674 / (273.15 + temperature);
+}
+
+// NWS: Steadman's approximation below 80 °F, Rothfusz regression with its adjustments above
+static float heat_index(float temperature, float humidity)
+{
+    float t = temperature * 9 / 5 + 32;
+    float hi = 0.5 * (t + 61.0 + (t - 68.0) * 1.2 + humidity * 0.094);
+    if((hi + t) / 2 >= 80) {
+        hi = -42.379 + 2.04901523 * t + 10.14333127 * humidity - 0.22475541 * t * humidity
+             - 0.00683783 * t * t - 0.05481717 * humidity * humidity + 0.00122874 * t * t * humidity
+             + 0.00085282 * t * humidity * humidity - 0.00000199 * t * t * humidity * humidity;
+        if(humidity < 13 && t > 80 && t < 112)
+            hi -= (13 - humidity) / 4 * sqrtf((17 - fabsf(t - 95)) / 17);
+        else if(humidity > 85 && t > 80 && t < 87)
+            hi += (humidity - 85) / 10 * (87 - t) / 5;
+    }
+    return (hi - 32) * 5 / 9;
+}
+
+static float aqi_from_pm2o5(float concentration)
+{
+    const int n = sizeof(aqi_breakpoints) / sizeof(aqi_breakpoints[0]);
+    concentration = concentration > 0 ? floorf(concentration * 10) / 10 : 0;    // truncated to the precision of the breakpoints
+    for(int i = 0; i < n; i++)
+        if(concentration <= aqi_breakpoints[i][1] || i == n - 1) {
+            const float *b = aqi_breakpoints[i];
+            float index = (b[3] - b[2]) / (b[1] - b[0]) * (concentration - b[0]) + b[2];
+            return roundf(index < b[3] ? index : b[3]);
+        }
+    return NAN;
+}
+
+// closes the hours elapsed since the last sample and adds this one, returns the mean of the window
+static float aqi_window_mean(derived_aqi_t *aqi, float pm2o5)
+{
+    int64_t now = esp_timer_get_time();
+
+    if(!aqi->used) {
+        aqi->used = true;
+        for(int i = 0; i < DERIVED_AQI_HOURS; i++)
+            aqi->hours[i] = NAN;
+        aqi->hour_start = now;
+    }
+    while(now - aqi->hour_start >= 3600 * 1000000LL) {
+        if(!isnan(aqi->hours[aqi->hour])) {     // leaving the window
+            aqi->sum -= aqi->hours[aqi->hour];
+            aqi->hours_count--;
+        }
+        aqi->hours[aqi->hour] = aqi->samples ? aqi->hour_sum / aqi->samples : NAN;
+        if(aqi->samples) {
+            aqi->sum += aqi->hours[aqi->hour];
+            aqi->hours_count++;
+        }
+        aqi->hour = (aqi->hour + 1) % DERIVED_AQI_HOURS;
+        aqi->hour_sum = 0;
+        aqi->samples = 0;
+        aqi->hour_start += 3600 * 1000000LL;
+    }
+    aqi->hour_sum += pm2o5;
+    aqi->samples++;
+
+    // the slot of the current hour still holds the mean of 24 hours ago, left out of the window
+    float sum = aqi->sum - (isnan(aqi->hours[aqi->hour]) ? 0 : aqi->hours[aqi->hour]);
+    uint8_t hours = aqi->hours_count - (isnan(aqi->hours[aqi->hour]) ? 0 : 1);
+    return hours + 1 >= DERIVED_AQI_HOURS_MIN ? (sum + aqi->hour_sum / aqi->samples) / (hours + 1) : NAN;
+}
+
+static derived_aqi_t *aqi_of_device(devices_index_t device)
+{
+    derived_aqi_t *unused = NULL;
+    for(int i = 0; i < DERIVED_AQI_NUM_MAX; i++) {
+        if(derived_aqi[i].used && derived_aqi[i].device == device)
+            return &derived_aqi[i];
+        if(!derived_aqi[i].used && !unused)
+            unused = &derived_aqi[i];
+    }
+    if(unused)
+        unused->device = device;
+    return unused;
+}
+
+// appends the metrics derived from the inputs noted by this pass, paired by device
+void derived_update()
+{
+    for(devices_index_t device = 0; device < DEVICES_NUM_MAX; device++) {
+        derived_inputs_t *inputs = &derived_inputs[device];
+        if(application.derived_humidity && (inputs->seen & (SEEN_TEMPERATURE | SEEN_HUMIDITY)) == (SEEN_TEMPERATURE | SEEN_HUMIDITY)
+          && inputs->humidity > 0) {
+            measurements_append_from_device(device, DERIVED_DEW_POINT, METRIC_DewPoint, inputs->timestamp, UNIT_Cel,
+                                            dew_point(inputs->temperature, inputs->humidity));
+            measurements_append_from_device(device, DERIVED_ABSOLUTE_HUMIDITY, METRIC_AbsoluteHumidity, inputs->timestamp, UNIT_g_m3,
+                                            absolute_humidity(inputs->temperature, inputs->humidity));
+            measurements_append_from_device(device, DERIVED_HEAT_INDEX, METRIC_HeatIndex, inputs->timestamp, UNIT_Cel,
+                                            heat_index(inputs->temperature, inputs->humidity));
+        }
+        if(application.derived_aqi && inputs->seen & SEEN_PM2o5) {
+            derived_aqi_t *aqi = aqi_of_device(device);
+            float mean = aqi ? aqi_window_mean(aqi, inputs->pm2o5) : NAN;
+            if(!isnan(mean))
+                measurements_append_from_device(device, DERIVED_AQI, METRIC_AQI, inputs->timestamp, UNIT_NONE, aqi_from_pm2o5(mean));
+        }
+        inputs->seen = 0;
+    }
+}
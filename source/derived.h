@@ -0,0 +1,48 @@
+// Copyright (c) 2024 José Francisco Castro <me@fran.cc>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef derived_h
+#define derived_h
+
+#define DERIVED_PARAMETER_FIRST		DEVICES_PARAMETERS_NUM_MAX	// derived rows use parameters beyond those of the devices
+#define DERIVED_AQI_NUM_MAX			4		// devices with a rolling PM2.5 window
+#define DERIVED_AQI_HOURS			24
+#define DERIVED_AQI_HOURS_MIN		18		// of the window with samples for the AQI to be reported
+
+#include <stdint.h>
+
+#include "devices.h"
+#include "measurements.h"
+
+enum derived_parameter {
+	DERIVED_DEW_POINT = DERIVED_PARAMETER_FIRST,
+	DERIVED_ABSOLUTE_HUMIDITY,
+	DERIVED_HEAT_INDEX,
+	DERIVED_AQI,
+};
+
+typedef struct {				// inputs noted by the current pass
+	float temperature;
+	float humidity;
+	float pm2o5;
+	measurement_timestamp_t timestamp;
+	uint8_t seen;				// bitmask of the metrics above
+} derived_inputs_t;
+
+typedef struct {				// kept incrementally, in RAM as deep sleep restarts the window
+	devices_index_t device;
+	bool used;
+	uint8_t hour;				// slot of the current hour
+	uint8_t hours_count;		// slots with a mean
+	uint16_t samples;			// of the current hour
+	float hour_sum;
+	float sum;					// of the hourly means in the window
+	float hours[DERIVED_AQI_HOURS];		// NAN for hours without samples
+	int64_t hour_start;			// esp_timer time
+} derived_aqi_t;
+
+void derived_init();
+void derived_note(devices_index_t device, measurement_metric_t metric, measurement_timestamp_t timestamp, float value);
+void derived_update();
+
+#endif
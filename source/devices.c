@@ -561,6 +561,10 @@ bool devices_measure_all()
     uint8_t device;
 
     for(device = 0; device < devices_count; device++) {
+        if(application_time_left() <= 0) {
+            ESP_LOGE(__func__, "wake budget exhausted, %u devices not measured", devices_count - device);
+            return false;
+        }
         switch(devices[device].resource) {
         case RESOURCE_I2C:
             devices[device].status = i2c_measure_device(device) ? DEVICE_STATUS_WORKING : DEVICE_STATUS_ERROR;
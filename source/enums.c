@@ -64,6 +64,9 @@ const char *backend_format_labels[] = {
 	[BACKEND_FORMAT_POSTMAN]	"postman",
 	[BACKEND_FORMAT_TEMPLATE]	"template",
 	[BACKEND_FORMAT_FRAME]		"frame",
+	[BACKEND_FORMAT_SENML_COMPACT]	"senml_compact",
+	[BACKEND_FORMAT_SENML_CBOR]		"senml_cbor",
+	[BACKEND_FORMAT_BATCH]			"batch",
 };
 
 const char *ble_mode_labels[] = {
@@ -107,6 +110,12 @@ const char *metric_labels[] = {
 	[METRIC_DCvoltage]				"DCvoltage",
 	[METRIC_ADCvalue]				"ADCvalue",
 	[METRIC_ProcessorTemperature]	"ProcessorTemperature",
+	[METRIC_AwakeTime]				"AwakeTime",
+	[METRIC_ConnectTime]			"ConnectTime",
+	[METRIC_DewPoint]				"DewPoint",
+	[METRIC_AbsoluteHumidity]		"AbsoluteHumidity",
+	[METRIC_HeatIndex]				"HeatIndex",
+	[METRIC_AQI]					"AQI",
 };
 
 const char *unit_labels[] = {
@@ -123,6 +132,22 @@ const char *unit_labels[] = {
 	[UNIT_ratio]	"/",
 	[UNIT_s]		"s",
 	[UNIT_B]		"B",
+	[UNIT_g_m3]		"g/m3",
+};
+
+const char *alarm_condition_labels[] = {
+	[ALARM_CONDITION_NONE]	"",
+	[ALARM_CONDITION_ABOVE]	"above",
+	[ALARM_CONDITION_BELOW]	"below",
+};
+
+const char *aggregate_labels[] = {	// appended to the metric in paths
+	[AGGREGATE_NONE]	"",
+	[AGGREGATE_MIN]		"_min",
+	[AGGREGATE_MAX]		"_max",
+	[AGGREGATE_MEAN]	"_mean",
+	[AGGREGATE_LAST]	"_last",
+	[AGGREGATE_COUNT]	"_count",
 };
 
 const char *wifi_status_labels[] = {
@@ -79,6 +79,9 @@ enum backend_format {
 	BACKEND_FORMAT_POSTMAN,
 	BACKEND_FORMAT_TEMPLATE,
 	BACKEND_FORMAT_FRAME,
+	BACKEND_FORMAT_SENML_COMPACT,
+	BACKEND_FORMAT_SENML_CBOR,
+	BACKEND_FORMAT_BATCH,
 	BACKEND_FORMAT_NUM_MAX
 };
 extern const char *backend_format_labels[];
@@ -159,6 +162,12 @@ enum metric {
 	METRIC_DCvoltage,
 	METRIC_ADCvalue,
 	METRIC_ProcessorTemperature,
+	METRIC_AwakeTime,
+	METRIC_ConnectTime,
+	METRIC_DewPoint,
+	METRIC_AbsoluteHumidity,
+	METRIC_HeatIndex,
+	METRIC_AQI,
 	METRIC_NUM_MAX
 };
 extern const char *metric_labels[];
@@ -178,11 +187,33 @@ enum unit {
 	UNIT_ratio,
 	UNIT_s,
 	UNIT_B,
+	UNIT_g_m3,
 	UNIT_NUM_MAX
 };
 extern const char *unit_labels[];
 typedef enum unit unit_enum_t;
 
+enum alarm_condition {
+	ALARM_CONDITION_NONE = 0,
+	ALARM_CONDITION_ABOVE,
+	ALARM_CONDITION_BELOW,
+	ALARM_CONDITION_NUM_MAX
+};
+extern const char *alarm_condition_labels[];
+typedef enum alarm_condition alarm_condition_t;
+
+enum aggregate {
+	AGGREGATE_NONE = 0,
+	AGGREGATE_MIN,
+	AGGREGATE_MAX,
+	AGGREGATE_MEAN,
+	AGGREGATE_LAST,
+	AGGREGATE_COUNT,
+	AGGREGATE_NUM_MAX
+};
+extern const char *aggregate_labels[];
+typedef enum aggregate aggregate_t;
+
 enum wifi_status {
 	WIFI_STATUS_DISCONNECTED = 0,
 	WIFI_STATUS_ERROR,
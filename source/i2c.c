@@ -754,7 +754,7 @@ bool i2c_measure_sht3x(devices_index_t device)
     float humidity = (((raw_buf[3] << 8 | raw_buf[4]) * 100) / 65535.0);
     humidity = humidity > 100 ? 100 : (humidity < 0 ? 0 : humidity);
 
-    time_t timestamp = NOW;
+    measurement_timestamp_t timestamp = NOW_MS;
     ESP_LOGI(__func__, "%f C, %f %%", temperature, humidity);
     return measurements_append_from_device(device, 0, METRIC_Temperature, timestamp, UNIT_Cel, temperature) &&
            measurements_append_from_device(device, 1, METRIC_Humidity, timestamp, UNIT_RH, humidity);
@@ -798,7 +798,7 @@ bool i2c_measure_sht4x(devices_index_t device)
     float humidity = (((raw_buf[3] << 8 | raw_buf[4]) * 125) / 65535.0) - 6;
     humidity = humidity > 100 ? 100 : (humidity < 0 ? 0 : humidity);
 
-    time_t timestamp = NOW;
+    measurement_timestamp_t timestamp = NOW_MS;
     ESP_LOGI(__func__, "%f C, %f %%", temperature, humidity);
     return measurements_append_from_device(device, 0, METRIC_Temperature, timestamp, UNIT_Cel, temperature) &&
            measurements_append_from_device(device, 1, METRIC_Humidity, timestamp, UNIT_RH, humidity);
@@ -857,7 +857,7 @@ bool i2c_measure_htu21d(devices_index_t device)
     float humidity = (((h_data[0] << 8 | h_data[1]) * 125) / 65536.0) - 6;
     humidity = humidity > 100 ? 100 : (humidity < 0 ? 0 : humidity);
 
-    time_t timestamp = NOW;
+    measurement_timestamp_t timestamp = NOW_MS;
     ESP_LOGI(__func__, "%f C, %f %%", temperature, humidity);
     return measurements_append_from_device(device, 0, METRIC_Temperature, timestamp, UNIT_Cel, temperature) &&
            measurements_append_from_device(device, 1, METRIC_Humidity, timestamp, UNIT_RH, humidity);
@@ -889,7 +889,7 @@ bool i2c_measure_htu31d(devices_index_t device)
     float humidity = (((th_data[3] << 8 | th_data[4]) * 100) / 65535.0);
     humidity = humidity > 100 ? 100 : (humidity < 0 ? 0 : humidity);
 
-    time_t timestamp = NOW;
+    measurement_timestamp_t timestamp = NOW_MS;
     ESP_LOGI(__func__, "%f C, %f %%", temperature, humidity);
     return measurements_append_from_device(device, 0, METRIC_Temperature, timestamp, UNIT_Cel, temperature) &&
            measurements_append_from_device(device, 1, METRIC_Humidity, timestamp, UNIT_RH, humidity);
@@ -922,7 +922,7 @@ bool i2c_measure_mcp9808(devices_index_t device)
     else
         temperature = measure_data[0] * 16.0 + measure_data[1] / 16.0;
 
-    time_t timestamp = NOW;
+    measurement_timestamp_t timestamp = NOW_MS;
     ESP_LOGI(__func__, "%f C", temperature);
     return measurements_append_from_device(device, 0, METRIC_Temperature, timestamp, UNIT_Cel, temperature);
 }
@@ -947,7 +947,7 @@ bool i2c_measure_tmp117(devices_index_t device)
 
     float temperature = 0.007812 * (int16_t)(measure_data[0] << 8 | measure_data[1]);
 
-    time_t timestamp = NOW;
+    measurement_timestamp_t timestamp = NOW_MS;
     ESP_LOGI(__func__, "%f C", temperature);
     return measurements_append_from_device(device, 0, METRIC_Temperature, timestamp, UNIT_Cel, temperature);
 }
@@ -978,7 +978,7 @@ bool i2c_measure_lps2x3x(devices_index_t device)
     float pressure = twos_complement((int32_t)((pt_data[2] << 16) | (pt_data[1] << 8) | pt_data[0]), 24) / 4096.0;
     float temperature = (int16_t)(pt_data[4] << 8 | pt_data[3]) / 100.0;
 
-    time_t timestamp = NOW;
+    measurement_timestamp_t timestamp = NOW_MS;
     ESP_LOGI(__func__, "%f C, %f hPa", temperature,  pressure);
     return measurements_append_from_device(device, 0, METRIC_Pressure, timestamp, UNIT_hPa, pressure) &&
            measurements_append_from_device(device, 1, METRIC_Temperature, timestamp, UNIT_Cel, temperature);
@@ -1047,7 +1047,7 @@ bool i2c_measure_bmp280(devices_index_t device)
     pressure_int = (uint32_t) ((int32_t) pressure_int + ((var1 + var2 + P7) / 16));
     float pressure = pressure_int / 100.0;
 
-    time_t timestamp = NOW;
+    measurement_timestamp_t timestamp = NOW_MS;
     ESP_LOGI(__func__, "%f C, %f hPa", temperature,  pressure);
     return measurements_append_from_device(device, 0, METRIC_Pressure, timestamp, UNIT_hPa, pressure) &&
            measurements_append_from_device(device, 1, METRIC_Temperature, timestamp, UNIT_Cel, temperature);
@@ -1127,7 +1127,7 @@ bool i2c_measure_bmp388(devices_index_t device)
     p_partial_data4 = (p_offset / 4) + p_partial_data1 + p_partial_data5 + p_partial_data3;
     float pressure = (((uint64_t)p_partial_data4 * 25) / (uint64_t)1099511627776) / 10000.0;
 
-    time_t timestamp = NOW;
+    measurement_timestamp_t timestamp = NOW_MS;
     ESP_LOGI(__func__, "%f C, %f hPa", temperature, pressure);
     return measurements_append_from_device(device, 0, METRIC_Pressure, timestamp, UNIT_hPa, pressure) &&
            measurements_append_from_device(device, 1, METRIC_Temperature, timestamp, UNIT_Cel, temperature);
@@ -1193,7 +1193,7 @@ bool i2c_measure_dps310(devices_index_t device)
                  scaled_raw_temperature * ((int32_t)c01 + pressure * ((int32_t)c11 + pressure * (int32_t)c21));
     pressure /= 100.0;
 
-    time_t timestamp = NOW;
+    measurement_timestamp_t timestamp = NOW_MS;
     ESP_LOGI(__func__, "%f C, %f hPa", temperature,  pressure);
     return measurements_append_from_device(device, 0, METRIC_Pressure, timestamp, UNIT_hPa, pressure) &&
            measurements_append_from_device(device, 1, METRIC_Temperature, timestamp, UNIT_Cel, temperature);
@@ -1243,7 +1243,7 @@ bool i2c_measure_mlx90614(devices_index_t device)
         return false;
     float object_temperature = (t_obj1_data[4] << 8 | t_obj1_data[3]) / 50.0 - 273.15;
 
-    time_t timestamp = NOW;
+    measurement_timestamp_t timestamp = NOW_MS;
     ESP_LOGI(__func__, "%f C object, %f C ambient", object_temperature, ambient_temperature);
     return measurements_append_from_device(device, 0, METRIC_InfraredTemperature, timestamp, UNIT_Cel, object_temperature) &&
            measurements_append_from_device(device, 1, METRIC_InternalTemperature, timestamp, UNIT_Cel, ambient_temperature);
@@ -1278,7 +1278,7 @@ bool i2c_measure_mcp960x(devices_index_t device)
         return false;
     float ambient_temperature = ((int16_t) cold_junction_data[0] << 8 | cold_junction_data[1]) * 0.0625;
 
-    time_t timestamp = NOW;
+    measurement_timestamp_t timestamp = NOW_MS;
     ESP_LOGI(__func__, "%f C probe, %f C ambient", probe_temperature, ambient_temperature);
     return measurements_append_from_device(device, 0, METRIC_ProbeTemperature, timestamp, UNIT_Cel, probe_temperature) &&
            measurements_append_from_device(device, 1, METRIC_InternalTemperature, timestamp, UNIT_Cel, ambient_temperature);
@@ -1309,7 +1309,7 @@ bool i2c_measure_bh1750(devices_index_t device)
         return false;
     float lux = (measure_data[0] << 8 | measure_data[1]) / 1.2;
 
-    time_t timestamp = NOW;
+    measurement_timestamp_t timestamp = NOW_MS;
     ESP_LOGI(__func__, "%f lux", lux);
     return measurements_append_from_device(device, 0, METRIC_LightIntensity, timestamp, UNIT_lux, lux);
 }
@@ -1322,21 +1322,21 @@ bool i2c_detect_veml7700(device_bus_t bus, device_address_t address)
 
 bool i2c_measure_veml7700(devices_index_t device)
 {
-    if(NOW < 1000000)
+    if(esp_timer_get_time() < 1000000)     // restarts on every wake, unlike the wall clock
         vTaskDelay(100 / portTICK_PERIOD_MS);  // await for complete integration after power up or waking up from sleep
     uint8_t als_cmd[] = { 0x04 };
     uint8_t als_data[2];
     if(i2c_master_write_read_device(i2c_buses[devices[device].bus].port, devices[device].address, als_cmd, sizeof(als_cmd), als_data, sizeof(als_data), I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS))
         return false;
     float lux = (als_data[1] << 8 | als_data[0]) * 0.2304;
-    time_t timestamp = NOW;
+    measurement_timestamp_t timestamp = NOW_MS;
     ESP_LOGI(__func__, "%f lux", lux);
     return measurements_append_from_device(device, 0, METRIC_LightIntensity, timestamp, UNIT_lux, lux);
 }
 
 bool i2c_detect_tsl2591(device_bus_t bus, device_address_t address)
 {
-    if(NOW < 1000000)
+    if(esp_timer_get_time() < 1000000)     // restarts on every wake, unlike the wall clock
         vTaskDelay(100 / portTICK_PERIOD_MS);  // await for complete integration after power up or waking up from sleep
     uint8_t id_cmd[] = { 0x12 | 0x80 };
     uint8_t id_data[1];
@@ -1366,7 +1366,7 @@ bool i2c_measure_tsl2591(devices_index_t device)
     float cpl = (100.0 * 1.0) / 408.0;     // integration time in ms * gain / lux coefficient
     float lux = (((float)channel0 - (float)channel1)) * (1.0F - ((float)channel1 / (float)channel0)) / cpl;
 
-    time_t timestamp = NOW;
+    measurement_timestamp_t timestamp = NOW_MS;
     ESP_LOGI(__func__, "%f lux", lux);
     return measurements_append_from_device(device, 0, METRIC_LightIntensity, timestamp, UNIT_lux, lux);
  }
@@ -1424,7 +1424,7 @@ bool i2c_measure_scd4x(devices_index_t device)
     float humidity = ((raw_buf[6] << 8 | raw_buf[7]) * 100) / 65535.0;
     humidity = humidity > 100 ? 100 : (humidity < 0 ? 0 : humidity);
 
-    time_t timestamp = NOW;
+    measurement_timestamp_t timestamp = NOW_MS;
     ESP_LOGI(__func__, "%f CO2 ppm, %f C, %f %%", co2, temperature, humidity);
     return measurements_append_from_device(device, 0, METRIC_CO2, timestamp, UNIT_ppm, co2) &&
            measurements_append_from_device(device, 1, METRIC_Temperature, timestamp, UNIT_Cel, temperature) &&
@@ -1509,7 +1509,7 @@ bool i2c_measure_sen5x(devices_index_t device)
     voc = voc < 1 || voc > 500 ? 1 : voc;
     nox = nox < 1 || nox > 500 ? 1 : nox;
 
-    time_t timestamp = NOW;
+    measurement_timestamp_t timestamp = NOW_MS;
 
     switch(product_name_data[6]) {
     case '0':
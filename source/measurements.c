@@ -2,11 +2,18 @@
 // SPDX-License-Identifier: GPL-3.0-or-later
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <esp_attr.h>
 #include <esp_log.h>
+#include <esp_random.h>
 
 #include "adc.h"
+#include "aggregates.h"
 #include "application.h"
 #include "board.h"
+#include "cbor.h"
+#include "deadbands.h"
+#include "derived.h"
 #include "devices.h"
 #include "enums.h"
 #include "hmac.h"
@@ -16,11 +23,18 @@
 #include "postman.h"
 #include "pbuf.h"
 #include "schema.h"
-#include "wifi.h"
 
 bool measurements_full = false;
 measurements_index_t measurements_count = 0;
 measurement_t measurements[MEASUREMENTS_NUM_MAX] = {{0}};
+RTC_DATA_ATTR measurements_dictionary_t measurements_dictionary = {0};
+RTC_DATA_ATTR measurements_saved_t measurements_saved[MEASUREMENTS_SAVED_NUM_MAX];
+RTC_DATA_ATTR measurements_index_t measurements_saved_count = 0;
+RTC_DATA_ATTR measurements_index_t measurements_cycle_count = 0;     // rows added by the last wake
+RTC_DATA_ATTR int64_t measurements_saved_epoch = 0;                  // of the saved rows captured with the clock set
+static measurement_timestamp_t measurements_saved_timestamps[MEASUREMENTS_SAVED_NUM_MAX];   // unpacked while saving
+measurements_index_t measurements_restored_count = 0;
+int8_t measurements_backend = -1;      // whose filter selects the rows being encoded, -1 for every row
 
 measurement_descriptor_t measurements_build_descriptor(measurement_tag_t tag, resource_t resource, device_bus_t bus,
     device_multiplexer_t multiplexer, device_channel_t channel, device_part_t part, device_parameter_t parameter,
@@ -37,13 +51,13 @@ measurement_descriptor_t measurements_build_descriptor(measurement_tag_t tag, re
            ((uint64_t)(unit & 0xFF) << 56);
 }
 
-bool measurements_build_path(pbuf_t *buf, measurements_index_t measurement, char separator)
+bool measurements_build_base_path(pbuf_t *buf, measurements_index_t measurement, char separator)
 {
     switch(measurements[measurement].resource) {
     case RESOURCE_I2C:
     case RESOURCE_ONEWIRE:
     case RESOURCE_BLE:
-        return pbuf_printf(buf, "%016llX%c%s%c%i%c%i%c%i%c%016llX%c%s%c%i%c%s",
+        return pbuf_printf(buf, "%016llX%c%s%c%i%c%i%c%i%c%016llX%c%s%c",
             measurements[measurement].node,
             separator,
             resource_labels[measurements[measurement].resource],
@@ -57,29 +71,164 @@ bool measurements_build_path(pbuf_t *buf, measurements_index_t measurement, char
             measurements[measurement].address,
             separator,
             parts[measurements[measurement].part].label,
-            separator,
-            measurements[measurement].parameter,
-            separator,
-            metric_labels[measurements[measurement].metric]);
-    case RESOURCE_ADC:
-        return pbuf_printf(buf, "%016llX%c%s%c%i%c%s",
+            separator);
+    default:
+        return pbuf_printf(buf, "%016llX%c%s%c",
             measurements[measurement].node,
             separator,
             resource_labels[measurements[measurement].resource],
-            separator,
+            separator);
+    }
+}
+
+bool measurements_build_leaf_path(pbuf_t *buf, measurements_index_t measurement, char separator)
+{
+    switch(measurements[measurement].resource) {
+    case RESOURCE_I2C:
+    case RESOURCE_ONEWIRE:
+    case RESOURCE_BLE:
+    case RESOURCE_ADC:
+        return pbuf_printf(buf, "%i%c%s%s",
             measurements[measurement].parameter,
             separator,
-            metric_labels[measurements[measurement].metric]);
+            metric_labels[measurements[measurement].metric],
+            aggregate_labels[measurements[measurement].aggregate]);
     default:
-        return pbuf_printf(buf, "%016llX%c%s%c%s",
-            measurements[measurement].node,
-            separator,
-            resource_labels[measurements[measurement].resource],
-            separator,
-            metric_labels[measurements[measurement].metric]);
+        return pbuf_printf(buf, "%s%s",
+            metric_labels[measurements[measurement].metric],
+            aggregate_labels[measurements[measurement].aggregate]);
+    }
+}
+
+bool measurements_build_path(pbuf_t *buf, measurements_index_t measurement, char separator)
+{
+    return measurements_build_base_path(buf, measurement, separator) &&
+           measurements_build_leaf_path(buf, measurement, separator);
+}
+
+bool measurements_have_same_base(measurements_index_t a, measurements_index_t b)
+{
+    if(measurements[a].node != measurements[b].node || measurements[a].resource != measurements[b].resource)
+        return false;
+
+    switch(measurements[a].resource) {
+    case RESOURCE_I2C:
+    case RESOURCE_ONEWIRE:
+    case RESOURCE_BLE:
+        return measurements[a].bus == measurements[b].bus &&
+               measurements[a].multiplexer == measurements[b].multiplexer &&
+               measurements[a].channel == measurements[b].channel &&
+               measurements[a].address == measurements[b].address &&
+               measurements[a].part == measurements[b].part;
+    default:
+        return true;
+    }
+}
+
+void measurements_select(int8_t backend)
+{
+    measurements_backend = backend;
+}
+
+// whether the row passes the filter of the backend being encoded
+bool measurements_selected(measurements_index_t index)
+{
+    if(measurements_backend < 0 || !backends[measurements_backend].filters_count)
+        return true;
+
+    backend_t *backend = &backends[measurements_backend];
+    measurement_descriptor_t descriptor = measurements_build_descriptor(0,
+        measurements[index].resource, measurements[index].bus, measurements[index].multiplexer, measurements[index].channel,
+        measurements[index].part, measurements[index].parameter, measurements[index].metric, measurements[index].unit);
+    char path[MEASUREMENTS_PATH_LENGTH];
+    pbuf_t buf = { path, sizeof(path), 0 };
+    bool includes = false;
+    bool included = false;
+
+    for(int i = 0; i < backend->filters_count; i++) {
+        backend_filter_t *filter = &backend->filters[i];
+        bool match = (descriptor & filter->mask) == filter->value && (!filter->node || filter->node == measurements[index].node);
+        if(match && filter->path[0]) {
+            if(!buf.length)
+                measurements_build_path(&buf, index, '_');
+            match = !strncmp(path, filter->path, strlen(filter->path));
+        }
+        if(match && filter->exclude)
+            return false;
+        includes = includes || !filter->exclude;
+        included = included || (match && !filter->exclude);
     }
+    return !includes || included;
+}
+
+measurements_index_t measurements_selected_count()
+{
+    measurements_index_t count = measurements_full ? MEASUREMENTS_NUM_MAX : measurements_count;
+    measurements_index_t selected = 0;
+    for(int n = 0; n < count; n++)
+        selected += measurements_selected(measurements_full ? (measurements_count + n) % MEASUREMENTS_NUM_MAX : n);
+    return selected;
 }
 
+// wall clock of a row in milliseconds, 0 if the clock was not set yet
+measurement_timestamp_t measurements_timestamp(measurements_index_t index)
+{
+    return measurements[index].timestamp > NOW_VALID_MIN_MS ? measurements[index].timestamp : NOW * 1000LL;
+}
+
+static measurement_timestamp_t measurements_saved_timestamp(measurements_index_t i)
+{
+    return measurements_saved[i].row.timestamp + (measurements_saved[i].aggregate & MEASUREMENTS_SAVED_WALL ? measurements_saved_epoch : 0);
+}
+
+// Saved rows keep their timestamp as a millisecond offset in 32 bits: from the oldest saved row captured
+// with the clock set, or from the cold boot for the ones captured before. Rows out of range are dropped.
+static void measurements_saved_pack()
+{
+    measurements_index_t count = 0;
+
+    measurements_saved_epoch = INT64_MAX;
+    for(int i = 0; i < measurements_saved_count; i++)
+        if(measurements_saved_timestamps[i] > NOW_VALID_MIN_MS && measurements_saved_timestamps[i] < measurements_saved_epoch)
+            measurements_saved_epoch = measurements_saved_timestamps[i];
+    for(int i = 0; i < measurements_saved_count; i++) {
+        bool wall = measurements_saved_timestamps[i] > NOW_VALID_MIN_MS;
+        int64_t offset = measurements_saved_timestamps[i] - (wall ? measurements_saved_epoch : 0);
+        if(offset < 0 || offset > UINT32_MAX) {
+            ESP_LOGW(__func__, "row dropped, timestamp %lli out of range", (long long int) measurements_saved_timestamps[i]);
+            continue;
+        }
+        measurements_saved[count] = measurements_saved[i];
+        measurements_saved[count].row.timestamp = offset;
+        measurements_saved[count].aggregate = (measurements_saved[i].aggregate & ~MEASUREMENTS_SAVED_WALL) | (wall ? MEASUREMENTS_SAVED_WALL : 0);
+        count++;
+    }
+    measurements_saved_count = count;
+}
+
+// Rows captured before the clock was set count from the last cold boot, like the system time did,
+// and are shifted to the wall clock once it is set. Called with the uploads lock held.
+void measurements_resolve()
+{
+    int64_t shift;
+    int resolved = 0;
+
+    if(!now_take_shift(&shift))
+        return;
+    for(int i = 0; i < MEASUREMENTS_NUM_MAX; i++)
+        if(measurements[i].timestamp <= NOW_VALID_MIN_MS) {
+            measurements[i].timestamp += shift;
+            resolved++;
+        }
+    for(int i = 0; i < measurements_saved_count; i++) {
+        measurements_saved_timestamps[i] = measurements_saved_timestamp(i);
+        if(measurements_saved_timestamps[i] <= NOW_VALID_MIN_MS)
+            measurements_saved_timestamps[i] += shift;
+    }
+    measurements_saved_pack();
+    aggregates_resolve(shift);
+    ESP_LOGI(__func__, "%i rows shifted by %lli ms", resolved, (long long int) shift);
+}
 
 bool measurements_entry_to_frame(measurements_index_t index, measurement_frame_t *frame)
 {
@@ -95,14 +244,14 @@ bool measurements_entry_to_frame(measurements_index_t index, measurement_frame_t
                          measurements[index].metric,
                          measurements[index].unit);
     frame->address = measurements[index].address;
-    frame->timestamp    = measurements[index].timestamp;
+    frame->timestamp    = measurements_timestamp(index) / 1000;     // whole seconds, frames have a fixed size
     frame->value   = measurements[index].value;
-    return true;
+    return measurements[index].aggregate == AGGREGATE_NONE;     // frames have no place for the aggregate, only saving keeps them
 }
 
 bool measurements_entry_to_adv(measurements_index_t index, measurement_adv_t *adv)
 {
-    if(measurements[index].node != board.id)
+    if(measurements[index].node != board.id || measurements[index].aggregate != AGGREGATE_NONE)
         return false;
 
     adv->descriptor    = measurements_build_descriptor(
@@ -116,11 +265,125 @@ bool measurements_entry_to_adv(measurements_index_t index, measurement_adv_t *ad
                        measurements[index].metric,
                        measurements[index].unit);
     adv->address = measurements[index].address;
-    adv->timestamp    = measurements[index].timestamp;
+    adv->timestamp    = measurements_timestamp(index) / 1000;
     adv->value   = measurements[index].value;
     return true;
 }
 
+void measurements_dictionary_reset()
+{
+    memset(&measurements_dictionary, 0, sizeof(measurements_dictionary));
+    while(!measurements_dictionary.session)
+        measurements_dictionary.session = esp_random();
+    ESP_LOGI(__func__, "new batch session %08lx", (unsigned long) measurements_dictionary.session);
+}
+
+static int measurements_dictionary_find(measurements_index_t index, measurements_series_t *series)
+{
+    series->node = measurements[index].node;
+    series->descriptor = measurements_build_descriptor(
+                         measurements[index].node & 0xFF,
+                         measurements[index].resource,
+                         measurements[index].bus,
+                         measurements[index].multiplexer,
+                         measurements[index].channel,
+                         measurements[index].part,
+                         measurements[index].parameter,
+                         measurements[index].metric,
+                         measurements[index].unit);
+    series->address = measurements[index].address;
+    for(int id = 0; id < measurements_dictionary.count; id++)
+        if(!memcmp(&measurements_dictionary.series[id], series, sizeof(measurements_series_t)))
+            return id;
+    return -1;
+}
+
+static bool put_varint(pbuf_t *buf, uint32_t value)
+{
+    char byte;
+    do {
+        byte = (value & 0x7F) | (value > 0x7F ? 0x80 : 0);
+        value >>= 7;
+        if(!pbuf_put(buf, &byte, 1))
+            return false;
+    } while(value);
+    return true;
+}
+
+// Datagram: magic:8 session:32 sequence:16 timestamp:32, then records keyed by a varint (id << 1 | definition).
+// A definition carries node:64 descriptor:64 address:64, a sample carries a zigzag varint timestamp delta in
+// milliseconds, from the previous sample or from the whole seconds of the header, and a float value.
+// Returns the number of measurements consumed, starting at ring position n, buf is left empty if none was a sample.
+measurements_index_t measurements_to_batch(int n, int count, uint8_t backend, pbuf_t *buf)
+{
+    measurements_series_t series;
+    measurements_index_t index = measurements_full ? (measurements_count + n) % MEASUREMENTS_NUM_MAX : n;
+
+    if(!measurements_dictionary.session ||
+       (measurements_dictionary_find(index, &series) < 0 && measurements_dictionary.count == MEASUREMENTS_DICTIONARY_NUM_MAX))
+        measurements_dictionary_reset();
+
+    uint16_t sequence = measurements_dictionary.sequence[backend];
+    bool resync = !(sequence % MEASUREMENTS_BATCH_RESYNC_INTERVAL);
+    uint32_t announced = 0;
+    uint32_t base = measurements_timestamp(index) / 1000;
+    measurement_timestamp_t timestamp = base * 1000LL;
+    char magic = MEASUREMENTS_BATCH_MAGIC;
+    size_t size = buf->size;
+    size_t start = buf->length;
+    int samples = 0;
+
+    if(buf->size > MEASUREMENTS_BATCH_LENGTH_MAX)
+        buf->size = MEASUREMENTS_BATCH_LENGTH_MAX;
+    bool ok = pbuf_put(buf, &magic, sizeof(magic)) &&
+              pbuf_put(buf, (char *) &measurements_dictionary.session, sizeof(measurements_dictionary.session)) &&
+              pbuf_put(buf, (char *) &sequence, sizeof(sequence)) &&
+              pbuf_put(buf, (char *) &base, sizeof(base));
+
+    measurements_index_t length = 0;
+    while(ok && n + length < count) {
+        index = measurements_full ? (measurements_count + n + length) % MEASUREMENTS_NUM_MAX : n + length;
+        if(!measurements_selected(index) || measurements[index].aggregate != AGGREGATE_NONE) {
+            length++;       // batches carry samples only
+            continue;
+        }
+        size_t record = buf->length;
+        int id = measurements_dictionary_find(index, &series);
+        if(id < 0) {
+            if(measurements_dictionary.count == MEASUREMENTS_DICTIONARY_NUM_MAX)
+                break;      // the next datagram starts a new session
+            id = measurements_dictionary.count++;
+            measurements_dictionary.series[id] = series;
+            measurements_dictionary.announced[id] = 0;
+        }
+        if(!(measurements_dictionary.announced[id] & (1 << backend)) || (resync && !(announced & (1u << id)))) {
+            ok = ok && put_varint(buf, id << 1 | 1) &&
+                 pbuf_put(buf, (char *) &series, sizeof(series));
+            announced |= 1u << id;
+        }
+        measurement_timestamp_t current = measurements_timestamp(index);
+        int32_t delta = current - timestamp;
+        ok = ok && put_varint(buf, id << 1) &&
+             put_varint(buf, ((uint32_t) delta << 1) ^ (uint32_t) (delta >> 31)) &&
+             pbuf_put(buf, (char *) &measurements[index].value, sizeof(measurements[index].value));
+        if(!ok) {
+            buf->length = record;       // did not fit, left for the next datagram
+            ok = length > 0;
+            break;
+        }
+        measurements_dictionary.announced[id] |= 1 << backend;
+        timestamp = current;
+        samples++;
+        length++;
+    }
+    buf->size = size;
+    if(!samples)
+        buf->length = start;        // a header alone is not sent, nor does it take a sequence number
+    else
+        measurements_dictionary.sequence[backend]++;
+    return ok ? length : 0;
+}
+
 void measurements_init()
 {
     measurements_full = false;
@@ -128,12 +391,89 @@ void measurements_init()
     memset(measurements, 0, sizeof(measurements));	
 }
 
+// keeps the rows of the ring in RTC memory during deep sleep, the newest ones if they do not fit
+void measurements_save()
+{
+    measurement_frame_t frame;
+    measurements_index_t count = measurements_full ? MEASUREMENTS_NUM_MAX : measurements_count;
+    measurements_index_t first = count > MEASUREMENTS_SAVED_NUM_MAX ? count - MEASUREMENTS_SAVED_NUM_MAX : 0;
+
+    measurements_cycle_count = count > measurements_restored_count ? count - measurements_restored_count : 0;
+    measurements_saved_count = 0;
+    for(int n = first; n < count; n++) {
+        measurements_index_t index = measurements_full ? (measurements_count + n) % MEASUREMENTS_NUM_MAX : n;
+        node_t node = { .address = measurements[index].node };
+        int node_index = node.address == board.id ? NODES_NUM_MAX : nodes_get(&node);
+        if(node_index < 0)
+            continue;
+        measurements_entry_to_frame(index, &frame);
+        measurements_saved[measurements_saved_count].row.descriptor = frame.descriptor;
+        measurements_saved[measurements_saved_count].row.address = frame.address;
+        measurements_saved_timestamps[measurements_saved_count] = measurements[index].timestamp;   // resolved on a later wake if needed
+        measurements_saved[measurements_saved_count].row.value = frame.value;
+        measurements_saved[measurements_saved_count].node = node_index;
+        measurements_saved[measurements_saved_count].aggregate = measurements[index].aggregate;
+        measurements_saved_count++;
+    }
+    measurements_saved_pack();
+    ESP_LOGI(__func__, "%u rows saved", measurements_saved_count);
+}
+
+// appends the rows saved by wakes without upload, before the ones of this wake
+void measurements_restore()
+{
+    for(int i = 0; i < measurements_saved_count; i++)
+        if(measurements_append_with_descriptor(measurements_saved[i].node == NODES_NUM_MAX ? board.id : nodes[measurements_saved[i].node].address,
+                                               measurements_saved[i].row.descriptor, measurements_saved[i].row.address,
+                                               measurements_saved_timestamp(i), measurements_saved[i].row.value))
+            measurements[(measurements_count + MEASUREMENTS_NUM_MAX - 1) % MEASUREMENTS_NUM_MAX].aggregate =
+                measurements_saved[i].aggregate & ~MEASUREMENTS_SAVED_WALL;
+    measurements_restored_count = measurements_saved_count;
+    measurements_saved_count = 0;
+}
+
+// whether the rows of the next wake would not fit after saving the ones of this wake
+bool measurements_saved_nearly_full()
+{
+    return measurements_saved_count + 2 * measurements_cycle_count > MEASUREMENTS_SAVED_NUM_MAX;
+}
+
 void measurements_measure()
 {
+    now_snapshot();
     devices_measure_all();
     adc_measure();
     application_measure();
     board_measure();
+    derived_update();
+    application_adapt();
+}
+
+static void reverse(measurements_index_t from, measurements_index_t to)
+{
+    while(from + 1 < to) {
+        measurement_t row = measurements[from];
+        measurements[from++] = measurements[--to];
+        measurements[to] = row;
+    }
+}
+
+// removes the rows for which drop returns true, keeping the others in order from the oldest
+void measurements_compact(bool (*drop)(measurement_t *row))
+{
+    measurements_index_t count = measurements_full ? MEASUREMENTS_NUM_MAX : measurements_count;
+    measurements_index_t kept = 0;
+
+    if(measurements_full) {     // rotates the oldest row to the start
+        reverse(0, measurements_count);
+        reverse(measurements_count, MEASUREMENTS_NUM_MAX);
+        reverse(0, MEASUREMENTS_NUM_MAX);
+    }
+    for(measurements_index_t index = 0; index < count; index++)
+        if(!drop(&measurements[index]))
+            measurements[kept++] = measurements[index];
+    measurements_full = kept == MEASUREMENTS_NUM_MAX;
+    measurements_count = kept % MEASUREMENTS_NUM_MAX;
 }
 
 static bool write_resource_schema(bp_pack_t *writer)
@@ -204,11 +544,13 @@ bool measurements_pack(bp_pack_t *bp)
     ok = ok && bp_create_container(bp, BP_LIST);
     for(int n = 0; n < count && ok; n++) {
         index = measurements_full ? (measurements_count + n) % MEASUREMENTS_NUM_MAX : n;
+        if(!measurements_selected(index))
+            continue;
         buf.length = 0;
         ok = ok && measurements_build_path(&buf, index, '_');
         ok = ok && bp_create_container(bp, BP_LIST);
             ok = ok && bp_put_string(bp, path);
-            ok = ok && bp_put_big_integer(bp, measurements[index].timestamp ? measurements[index].timestamp : NOW);
+            ok = ok && bp_put_big_integer(bp, measurements_timestamp(index) / 1000);
             ok = ok && bp_put_string(bp, unit_labels[measurements[index].unit]);
             ok = ok && bp_put_float(bp, measurements[index].value);
         ok = ok && bp_finish_container(bp);
@@ -248,7 +590,7 @@ bool measurements_entry_to_postman(measurements_index_t index, char *buffer, siz
     ok = ok && bp_create_container(&bp, BP_LIST);
         ok = ok && bp_create_container(&bp, BP_LIST);
             ok = ok && bp_put_string(&bp, path);
-            ok = ok && bp_put_big_integer(&bp, measurements[index].timestamp ? measurements[index].timestamp : NOW);
+            ok = ok && bp_put_big_integer(&bp, measurements_timestamp(index) / 1000);
             ok = ok && bp_put_string(&bp, unit_labels[measurements[index].unit]);
             ok = ok && bp_put_float(&bp, measurements[index].value);
         ok = ok && bp_finish_container(&bp);
@@ -279,13 +621,41 @@ bool measurements_to_postman(char *buffer, size_t *buffer_size, char *id, char *
     return ok;
 }
 
+bool measurements_sign_postman(char *buffer, size_t *buffer_size, size_t body_length, char *id, char *key)
+{
+    bp_pack_t bp;
+    bool ok = true;
+
+    bp_set_buffer(&bp, (bp_type_t *) buffer, *buffer_size / sizeof(bp_type_t));
+    ok = ok && bp_set_offset(&bp, body_length / sizeof(bp_type_t));
+    ok = ok && measurements_put_signature(&bp, id, key);
+
+    *buffer_size = ok ? bp_get_offset(&bp) * sizeof(bp_type_t) : 0;
+    return ok;
+}
+
+// SenML times are seconds, milliseconds go into the decimals when there are any
+static bool put_senml_time(pbuf_t *buf, int64_t milliseconds)
+{
+    if(!(milliseconds % 1000))
+        return pbuf_printf(buf, "%lli", milliseconds / 1000);
+    return pbuf_printf(buf, "%s%lli.%03lli", milliseconds < 0 ? "-" : "", llabs(milliseconds) / 1000, llabs(milliseconds) % 1000);
+}
+
+static bool cbor_put_senml_time(pbuf_t *buf, int64_t milliseconds)
+{
+    return milliseconds % 1000 ? cbor_put_double(buf, milliseconds / 1000.0) : cbor_put_integer(buf, milliseconds / 1000);
+}
+
 bool measurements_entry_to_senml_row(measurements_index_t index, pbuf_t *buf)
 {
     bool ok = true;
     ok = ok && pbuf_printf(buf,"{\"n\":\"urn:dev:mac:");
     ok = ok && measurements_build_path(buf, index, '_');
-    ok = ok && pbuf_printf(buf,"\",\"u\":\"%s\",\"v\":%f,\"t\":%lli}", unit_labels[measurements[index].unit],
-        measurements[index].value, (int64_t) (measurements[index].timestamp ? measurements[index].timestamp : NOW));
+    ok = ok && pbuf_printf(buf,"\",\"u\":\"%s\",\"v\":%f,\"t\":", unit_labels[measurements[index].unit],
+        measurements[index].value);
+    ok = ok && put_senml_time(buf, measurements_timestamp(index));
+    ok = ok && pbuf_putc(buf, '}');
     return ok;
 }
 
@@ -296,12 +666,64 @@ bool measurements_to_senml(char *buffer, size_t *buffer_size)
     measurements_index_t index = 0;
     measurements_index_t count = measurements_full ? MEASUREMENTS_NUM_MAX : measurements_count;
 
+    int rows = 0;
+
     ok = ok && pbuf_putc(&buf, '[');
     for(int n = 0; n != count && ok; n++) {
         index = measurements_full ? (measurements_count + n) % MEASUREMENTS_NUM_MAX : n;
+        if(!measurements_selected(index))
+            continue;
+        if(rows++)
+            ok = ok && pbuf_putc(&buf, ',');
         ok = ok && measurements_entry_to_senml_row(index, &buf);
-        if(n != count - 1)
+    }
+    ok = ok && pbuf_putc(&buf, ']');
+
+    *buffer_size = ok ? buf.length : 0;
+    return ok;
+}
+
+// RFC 8428 base fields: bn and bt are written at the start of each run of rows from the same
+// device, rows of the run carry only the name below the base and, if it differs, a relative time
+
+bool measurements_to_senml_compact(char *buffer, size_t *buffer_size)
+{
+    bool ok = true;
+    pbuf_t buf = { buffer, *buffer_size, 0 };
+    measurements_index_t index = 0;
+    measurements_index_t base_index = 0;
+    measurements_index_t count = measurements_full ? MEASUREMENTS_NUM_MAX : measurements_count;
+    int64_t base_timestamp = 0;
+    int64_t timestamp;
+    int rows = 0;
+
+    ok = ok && pbuf_putc(&buf, '[');
+    for(int n = 0; n != count && ok; n++) {
+        index = measurements_full ? (measurements_count + n) % MEASUREMENTS_NUM_MAX : n;
+        if(!measurements_selected(index))
+            continue;
+        timestamp = measurements_timestamp(index);
+        if(rows)
             ok = ok && pbuf_putc(&buf, ',');
+        ok = ok && pbuf_putc(&buf, '{');
+        if(!rows++ || !measurements_have_same_base(index, base_index)) {
+            base_index = index;
+            ok = ok && pbuf_printf(&buf, "\"bn\":\"urn:dev:mac:");
+            ok = ok && measurements_build_base_path(&buf, index, '_');
+            ok = ok && pbuf_printf(&buf, "\",");
+            if(rows == 1 || timestamp != base_timestamp) {
+                base_timestamp = timestamp;
+                ok = ok && pbuf_printf(&buf, "\"bt\":");
+                ok = ok && put_senml_time(&buf, base_timestamp);
+                ok = ok && pbuf_putc(&buf, ',');
+            }
+        }
+        ok = ok && pbuf_printf(&buf, "\"n\":\"");
+        ok = ok && measurements_build_leaf_path(&buf, index, '_');
+        ok = ok && pbuf_printf(&buf, "\",\"u\":\"%s\",\"v\":%f", unit_labels[measurements[index].unit], measurements[index].value);
+        if(timestamp != base_timestamp)
+            ok = ok && pbuf_printf(&buf, ",\"t\":") && put_senml_time(&buf, timestamp - base_timestamp);
+        ok = ok && pbuf_putc(&buf, '}');
     }
     ok = ok && pbuf_putc(&buf, ']');
 
@@ -309,7 +731,136 @@ bool measurements_to_senml(char *buffer, size_t *buffer_size)
     return ok;
 }
 
-bool measurements_entry_to_template_row(measurements_index_t index, pbuf_t *buf, char *template_row, char *template_path_separator)
+bool measurements_entry_to_senml_cbor_row(measurements_index_t index, pbuf_t *buf)
+{
+    bool ok = true;
+    char name[MEASUREMENTS_PATH_LENGTH];
+    pbuf_t name_buf = { name, sizeof(name), 0 };
+    const char *unit = unit_labels[measurements[index].unit];
+
+    ok = ok && pbuf_printf(&name_buf, "urn:dev:mac:");
+    ok = ok && measurements_build_path(&name_buf, index, '_');
+    ok = ok && cbor_put_map(buf, 4);
+    ok = ok && cbor_put_integer(buf, SENML_CBOR_NAME) && cbor_put_text(buf, name, name_buf.length);
+    ok = ok && cbor_put_integer(buf, SENML_CBOR_UNIT) && cbor_put_text(buf, unit, strlen(unit));
+    ok = ok && cbor_put_integer(buf, SENML_CBOR_VALUE) && cbor_put_float(buf, measurements[index].value);
+    ok = ok && cbor_put_integer(buf, SENML_CBOR_TIME) && cbor_put_senml_time(buf, measurements_timestamp(index));
+    return ok;
+}
+
+// Same base field runs as measurements_to_senml_compact(), with the integer labels of RFC 8428 section 6
+
+bool measurements_to_senml_cbor(char *buffer, size_t *buffer_size)
+{
+    bool ok = true;
+    pbuf_t buf = { buffer, *buffer_size, 0 };
+    char name[MEASUREMENTS_PATH_LENGTH];
+    pbuf_t name_buf = { name, sizeof(name), 0 };
+    measurements_index_t index = 0;
+    measurements_index_t base_index = 0;
+    measurements_index_t count = measurements_full ? MEASUREMENTS_NUM_MAX : measurements_count;
+    int64_t base_timestamp = 0;
+    int64_t timestamp;
+    bool new_base, new_base_timestamp;
+    const char *unit;
+
+    int rows = 0;
+
+    ok = ok && cbor_put_array(&buf, measurements_selected_count());
+    for(int n = 0; n != count && ok; n++) {
+        index = measurements_full ? (measurements_count + n) % MEASUREMENTS_NUM_MAX : n;
+        if(!measurements_selected(index))
+            continue;
+        timestamp = measurements_timestamp(index);
+        unit = unit_labels[measurements[index].unit];
+        new_base = !rows || !measurements_have_same_base(index, base_index);
+        new_base_timestamp = new_base && (!rows || timestamp != base_timestamp);
+        rows++;
+        if(new_base)
+            base_index = index;
+        if(new_base_timestamp)
+            base_timestamp = timestamp;
+
+        ok = ok && cbor_put_map(&buf, 3 + new_base + new_base_timestamp + (timestamp != base_timestamp));
+        if(new_base) {
+            name_buf.length = 0;
+            ok = ok && pbuf_printf(&name_buf, "urn:dev:mac:");
+            ok = ok && measurements_build_base_path(&name_buf, index, '_');
+            ok = ok && cbor_put_integer(&buf, SENML_CBOR_BASE_NAME) && cbor_put_text(&buf, name, name_buf.length);
+        }
+        if(new_base_timestamp)
+            ok = ok && cbor_put_integer(&buf, SENML_CBOR_BASE_TIME) && cbor_put_senml_time(&buf, base_timestamp);
+        name_buf.length = 0;
+        ok = ok && measurements_build_leaf_path(&name_buf, index, '_');
+        ok = ok && cbor_put_integer(&buf, SENML_CBOR_NAME) && cbor_put_text(&buf, name, name_buf.length);
+        ok = ok && cbor_put_integer(&buf, SENML_CBOR_UNIT) && cbor_put_text(&buf, unit, strlen(unit));
+        ok = ok && cbor_put_integer(&buf, SENML_CBOR_VALUE) && cbor_put_float(&buf, measurements[index].value);
+        if(timestamp != base_timestamp)
+            ok = ok && cbor_put_integer(&buf, SENML_CBOR_TIME) && cbor_put_senml_time(&buf, timestamp - base_timestamp);
+    }
+
+    *buffer_size = ok ? buf.length : 0;
+    return ok;
+}
+
+// Wide rows: rows of the same device and timestamp form a group and the row template is
+// expanded once per group. Per-row placeholders refer to the first row of the group and the
+// field list placeholders @f (line protocol) and @j (JSON members) expand to every row of it.
+
+bool measurements_template_is_wide(char *template_row)
+{
+    for(int j = 0; template_row[j] && template_row[j + 1]; j++) {
+        if(template_row[j] == '@') {
+            if(template_row[j + 1] == 'f' || template_row[j + 1] == 'j')
+                return true;
+            j += 1;
+        }
+    }
+    return false;
+}
+
+measurements_index_t measurements_group_length(int n, int count)
+{
+    measurements_index_t index = measurements_full ? (measurements_count + n) % MEASUREMENTS_NUM_MAX : n;
+    measurements_index_t length = 1;
+
+    for(int m = n + 1; m < count; m++, length++) {
+        measurements_index_t next = measurements_full ? (measurements_count + m) % MEASUREMENTS_NUM_MAX : m;
+        if(!measurements_have_same_base(index, next) || measurements[index].timestamp != measurements[next].timestamp)
+            break;      // rows the filter leaves out stay in the group, its fields skip them
+    }
+    return length;
+}
+
+// ISO 8601 in UTC with milliseconds, the epoch if the clock was not set yet
+static bool put_iso8601_time(pbuf_t *buf, int64_t milliseconds)
+{
+    struct tm tm;
+    time_t seconds = milliseconds / 1000;
+
+    gmtime_r(&seconds, &tm);
+    return pbuf_printf(buf, "%04i-%02i-%02iT%02i:%02i:%02i.%03iZ", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+                       tm.tm_hour, tm.tm_min, tm.tm_sec, (int) (milliseconds % 1000));
+}
+
+static bool put_template_fields(pbuf_t *buf, measurements_index_t index, measurements_index_t length, const char *format)
+{
+    bool ok = true;
+    char name[48];
+    int fields = 0;
+    for(int k = 0; k < length && ok; k++) {
+        measurements_index_t field = (index + k) % MEASUREMENTS_NUM_MAX;
+        if(!measurements_selected(field))
+            continue;
+        if(fields++)
+            ok = ok && pbuf_putc(buf, ',');
+        snprintf(name, sizeof(name), "%s%s", metric_labels[measurements[field].metric], aggregate_labels[measurements[field].aggregate]);
+        ok = ok && pbuf_printf(buf, format, name, measurements[field].value);
+    }
+    return ok;
+}
+
+bool measurements_group_to_template_row(measurements_index_t index, measurements_index_t length, pbuf_t *buf, char *template_row, char *template_path_separator)
 {
     bool ok = true;
     int template_row_length = strlen(template_row);
@@ -319,6 +870,11 @@ bool measurements_entry_to_template_row(measurements_index_t index, pbuf_t *buf,
                 case '@': ok = ok && pbuf_putc(buf, '@'); break;
                 case 'n': ok = ok && pbuf_printf(buf, "%016llX", board.id); break;
                 case 'p': ok = ok && measurements_build_path(buf, index, template_path_separator[0]); break;
+                case 's':   // base path without its trailing separator
+                    ok = ok && measurements_build_base_path(buf, index, template_path_separator[0]);
+                    if(ok)
+                        buf->data[--buf->length] = 0;
+                    break;
                 case 'r': ok = ok && pbuf_printf(buf, "%s", resource_labels[measurements[index].resource]); break;
                 case 'R': ok = ok && pbuf_printf(buf, "%s", measurements[index].resource ? resource_labels[measurements[index].resource] : "none"); break;
                 case 'b': ok = ok && pbuf_printf(buf, "%u", measurements[index].bus); break;
@@ -328,12 +884,16 @@ bool measurements_entry_to_template_row(measurements_index_t index, pbuf_t *buf,
                 case 'd': ok = ok && pbuf_printf(buf, "%s", parts[measurements[index].part].label); break;
                 case 'D': ok = ok && pbuf_printf(buf, "%s", measurements[index].part ? parts[measurements[index].part].label : "none"); break;
                 case 'e': ok = ok && pbuf_printf(buf, "%u", measurements[index].parameter); break;
-                case 'm': ok = ok && pbuf_printf(buf, "%s", metric_labels[measurements[index].metric]); break;
-                case 'M': ok = ok && pbuf_printf(buf, "%s", measurements[index].metric ? metric_labels[measurements[index].metric] : "none"); break;
+                case 'm': ok = ok && pbuf_printf(buf, "%s%s", metric_labels[measurements[index].metric], aggregate_labels[measurements[index].aggregate]); break;
+                case 'M': ok = ok && pbuf_printf(buf, "%s%s", measurements[index].metric ? metric_labels[measurements[index].metric] : "none", aggregate_labels[measurements[index].aggregate]); break;
                 case 'u': ok = ok && pbuf_printf(buf, "%s", unit_labels[measurements[index].unit]); break;
                 case 'U': ok = ok && pbuf_printf(buf, "%s", measurements[index].unit ? unit_labels[measurements[index].unit] : "none"); break;
                 case 'v': ok = ok && pbuf_printf(buf, "%f", measurements[index].value); break;
-                case 't': ok = ok && pbuf_printf(buf, "%lli", (int64_t) (measurements[index].timestamp ? measurements[index].timestamp : NOW)); break;
+                case 'f': ok = ok && put_template_fields(buf, index, length, "%s=%f"); break;
+                case 'j': ok = ok && put_template_fields(buf, index, length, "\"%s\":%f"); break;
+                case 't': ok = ok && pbuf_printf(buf, "%lli", measurements_timestamp(index) / 1000); break;
+                case 'T': ok = ok && pbuf_printf(buf, "%lli", measurements_timestamp(index)); break;
+                case 'i': ok = ok && put_iso8601_time(buf, measurements_timestamp(index)); break;
                 case '_': ok = ok && pbuf_printf(buf, "\n"); break;
                 case '<': ok = ok && pbuf_printf(buf, "\r"); break;
                 case '>': ok = ok && pbuf_printf(buf, "\t"); break;
@@ -347,19 +907,31 @@ bool measurements_entry_to_template_row(measurements_index_t index, pbuf_t *buf,
     return ok;
 }
 
+bool measurements_entry_to_template_row(measurements_index_t index, pbuf_t *buf, char *template_row, char *template_path_separator)
+{
+    return measurements_group_to_template_row(index, 1, buf, template_row, template_path_separator);
+}
+
 bool measurements_to_template(char *buffer, size_t *buffer_size, char *template_header, char *template_row, char *template_row_separator, char *template_path_separator, char *template_footer)
 {
     bool ok = true;
     pbuf_t buf = { buffer, *buffer_size, 0 };
     measurements_index_t index = 0;
+    measurements_index_t length = 1;
     measurements_index_t count = measurements_full ? MEASUREMENTS_NUM_MAX : measurements_count;
+    bool wide = measurements_template_is_wide(template_row);
+    int rows = 0;
 
     ok = ok && pbuf_printf(&buf, "%s", template_header);
-    for(int n = 0; n != count && ok; n++) {
+    for(int n = 0; n < count && ok; n += length) {
         index = measurements_full ? (measurements_count + n) % MEASUREMENTS_NUM_MAX : n;
-        ok = ok && measurements_entry_to_template_row(index, &buf, template_row, template_path_separator);
-        if(n != count - 1)
+        length = 1;
+        if(!measurements_selected(index))
+            continue;
+        length = wide ? measurements_group_length(n, count) : 1;
+        if(rows++)
             ok = ok && pbuf_printf(&buf, "%s", template_row_separator);
+        ok = ok && measurements_group_to_template_row(index, length, &buf, template_row, template_path_separator);
     }
     ok = ok && pbuf_printf(&buf, "%s", template_footer);
 
@@ -372,7 +944,7 @@ bool measurements_append(node_address_t node,           resource_t resource,
                          device_part_t part,                device_parameter_t parameter, measurement_metric_t metric,
                          measurement_timestamp_t timestamp, measurement_unit_t unit,      float value) // 😱
 {
-    if((application.queue || !measurements_full) && (!application.queue || timestamp > 1680000000)
+    if((application.queue || !measurements_full)
       && resource < RESOURCE_NUM_MAX && part < PART_NUM_MAX && metric < METRIC_NUM_MAX && unit < UNIT_NUM_MAX) {
         measurements[measurements_count].node = node;
         measurements[measurements_count].resource = resource;
@@ -383,9 +955,10 @@ bool measurements_append(node_address_t node,           resource_t resource,
         measurements[measurements_count].part = part;
         measurements[measurements_count].parameter = parameter;
         measurements[measurements_count].metric = metric;
-        measurements[measurements_count].timestamp = timestamp > 1680000000 ? timestamp : 0;
+        measurements[measurements_count].timestamp = timestamp ? timestamp : now_millis();     // captured now if unknown
         measurements[measurements_count].unit = unit;
         measurements[measurements_count].value = value;
+        measurements[measurements_count].aggregate = AGGREGATE_NONE;
 
         measurements_full = measurements_full ? true : measurements_count == MEASUREMENTS_NUM_MAX - 1;
         measurements_count = (measurements_count + 1) % MEASUREMENTS_NUM_MAX;
@@ -395,14 +968,32 @@ bool measurements_append(node_address_t node,           resource_t resource,
         return false;
 }
 
+bool measurements_append_row(measurement_t *row)
+{
+    if(!measurements_append(row->node, row->resource, row->bus, row->multiplexer, row->channel, row->address,
+                            row->part, row->parameter, row->metric, row->timestamp, row->unit, row->value))
+        return false;
+    measurements[(measurements_count + MEASUREMENTS_NUM_MAX - 1) % MEASUREMENTS_NUM_MAX].aggregate = row->aggregate;
+    return true;
+}
+
 bool measurements_append_from_device(devices_index_t device, device_parameter_t parameter, measurement_metric_t metric,
                                      measurement_timestamp_t timestamp, measurement_unit_t unit, float value)
 {
-    if(device < DEVICES_NUM_MAX && parameter < DEVICES_PARAMETERS_NUM_MAX
-      && (!devices[device].mask || devices[device].mask & 1 << parameter))
+    if(device < DEVICES_NUM_MAX && parameter >= DERIVED_PARAMETER_FIRST)    // computed from rows already offset
+        return measurements_append(board.id, devices[device].resource, devices[device].bus, devices[device].multiplexer,
+                                   devices[device].channel, devices[device].address, devices[device].part, parameter,
+                                   metric, timestamp, unit, value);
+    else if(device < DEVICES_NUM_MAX && parameter < DEVICES_PARAMETERS_NUM_MAX
+      && (!devices[device].mask || devices[device].mask & 1 << parameter)) {
+        derived_note(device, metric, timestamp, value + devices[device].offsets[parameter]);
+        application_track(device, parameter, value + devices[device].offsets[parameter]);
+        if(!deadbands_report(device, parameter, metric, value + devices[device].offsets[parameter]))
+            return true;    // within the deadband of the last reported value
         return measurements_append(board.id, devices[device].resource, devices[device].bus, devices[device].multiplexer,
                                    devices[device].channel, devices[device].address, devices[device].part, parameter,
                                    metric, timestamp, unit, value + devices[device].offsets[parameter]);
+    }
     else
         return false;
 }
@@ -426,10 +1017,10 @@ bool measurements_append_with_descriptor(node_address_t node, measurement_descri
 
 bool measurements_append_from_frame(measurement_frame_t *frame)
 {
-    return measurements_append_with_descriptor(frame->node, frame->descriptor, frame->address, frame->timestamp, frame->value);
+    return measurements_append_with_descriptor(frame->node, frame->descriptor, frame->address, frame->timestamp * 1000LL, frame->value);
 }
 
 bool measurements_append_from_adv(node_address_t node, measurement_adv_t *adv)
 {
-    return measurements_append_with_descriptor(node, adv->descriptor, adv->address, adv->timestamp, adv->value);
+    return measurements_append_with_descriptor(node, adv->descriptor, adv->address, adv->timestamp * 1000LL, adv->value);
 }
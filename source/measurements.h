@@ -7,8 +7,27 @@
 #define MEASUREMENTS_NUM_MAX		64
 #define MEASUREMENTS_PATH_LENGTH	128
 
+#define SENML_CBOR_BASE_NAME		-2		// RFC 8428 integer labels
+#define SENML_CBOR_BASE_TIME		-3
+#define SENML_CBOR_NAME				0
+#define SENML_CBOR_UNIT				1
+#define SENML_CBOR_VALUE			2
+#define SENML_CBOR_TIME				6
+
+#define MEASUREMENTS_BATCH_MAGIC			0xBB	// compact batch datagram with millisecond deltas, see tools/batch.py
+#define MEASUREMENTS_BATCH_LENGTH_MAX		1400	// stay below a typical MTU
+#define MEASUREMENTS_BATCH_RESYNC_INTERVAL	16		// datagrams between full dictionary announcements
+#define MEASUREMENTS_DICTIONARY_NUM_MAX		32		// ids must fit into a single varint byte with the definition flag
+
+#ifdef CONFIG_IDF_TARGET_ESP32C6
+	#define MEASUREMENTS_SAVED_NUM_MAX		MEASUREMENTS_NUM_MAX
+#else
+	#define MEASUREMENTS_SAVED_NUM_MAX		32		// 8 KB of RTC memory are shared with devices and nodes
+#endif
+
 #include <time.h>
 
+#include "backends.h"
 #include "devices.h"
 #include "bigpacks.h"
 #include "nodes.h"
@@ -18,7 +37,7 @@ typedef uint64_t measurement_descriptor_t;
 typedef uint8_t  measurement_tag_t;
 typedef uint16_t measurement_metric_t;
 typedef uint8_t  measurement_unit_t;
-typedef time_t   measurement_timestamp_t;
+typedef int64_t  measurement_timestamp_t;	// milliseconds
 typedef float    measurement_value_t;
 
 typedef struct {
@@ -34,6 +53,7 @@ typedef struct {
 	device_channel_t   	    channel;
 	device_parameter_t	    parameter;
 	measurement_unit_t      unit;
+	uint8_t					aggregate;		// of a window of rows of the same series, AGGREGATE_NONE for a sample
 } measurement_t;
 
 typedef struct {		// for LoRa, 32 bytes
@@ -51,28 +71,72 @@ typedef struct {		// for BLE ADV, 24 bytes
     float    value;
 } __attribute__((packed)) measurement_adv_t;
 
+typedef struct {		// dictionary entry for batches, a series is identified by its id once announced
+	uint64_t node;
+	uint64_t descriptor;
+    uint64_t address;
+} measurements_series_t;
+
+typedef struct {		// kept in RTC memory so that ids survive deep sleep
+	uint32_t session;	// regenerated on reset, tells the receiver to drop its dictionary
+	uint8_t count;
+	measurements_series_t series[MEASUREMENTS_DICTIONARY_NUM_MAX];
+	uint8_t announced[MEASUREMENTS_DICTIONARY_NUM_MAX];		// bitmask of backends the series was announced to
+	uint16_t sequence[BACKENDS_NUM_MAX];
+} measurements_dictionary_t;
+
+#define MEASUREMENTS_SAVED_WALL		0x80	// in aggregate, the timestamp is an offset from measurements_saved_epoch
+
+typedef struct {		// a row kept in RTC memory across wakes without upload, 26 bytes
+	measurement_adv_t row;		// with a millisecond offset as timestamp
+	uint8_t node;				// index in nodes, NODES_NUM_MAX for this board
+	uint8_t aggregate;
+} __attribute__((packed)) measurements_saved_t;
 
 typedef uint8_t measurements_index_t;
 extern bool measurements_full;
 extern measurements_index_t measurements_count;
 extern measurement_t measurements[];
+extern measurements_index_t measurements_saved_count;
 
 void measurements_init();
 void measurements_measure();
+void measurements_compact(bool (*drop)(measurement_t *row));
+bool measurements_append_row(measurement_t *row);
+void measurements_save();
+void measurements_restore();
+bool measurements_saved_nearly_full();
 bool measurements_entry_to_senml_row(measurements_index_t index, pbuf_t *buf);
+bool measurements_entry_to_senml_cbor_row(measurements_index_t index, pbuf_t *buf);
 bool measurements_entry_to_postman(measurements_index_t index, char *buffer, size_t *buffer_size, char *id, char *key);
 bool measurements_entry_to_template_row(measurements_index_t index, pbuf_t *buf, char *template_row, char *template_path_separator);
+bool measurements_group_to_template_row(measurements_index_t index, measurements_index_t length, pbuf_t *buf, char *template_row, char *template_path_separator);
+bool measurements_template_is_wide(char *template_row);
+measurements_index_t measurements_group_length(int n, int count);
 bool measurements_entry_to_frame(measurements_index_t index, measurement_frame_t *frame);
 bool measurements_entry_to_adv(measurements_index_t index, measurement_adv_t *adv);
+measurements_index_t measurements_to_batch(int n, int count, uint8_t backend, pbuf_t *buf);
+void measurements_dictionary_reset();
 measurement_descriptor_t measurements_build_descriptor(measurement_tag_t tag, resource_t resource, device_bus_t bus,
     										device_multiplexer_t multiplexer, device_channel_t channel,
     										device_part_t part, device_parameter_t parameter,
     										measurement_metric_t metric, measurement_unit_t unit);
 bool measurements_build_path(pbuf_t *buf, measurements_index_t measurement, char separator);
+bool measurements_build_base_path(pbuf_t *buf, measurements_index_t measurement, char separator);
+bool measurements_build_leaf_path(pbuf_t *buf, measurements_index_t measurement, char separator);
+bool measurements_have_same_base(measurements_index_t a, measurements_index_t b);
+measurement_timestamp_t measurements_timestamp(measurements_index_t index);
+void measurements_resolve();
+void measurements_select(int8_t backend);
+bool measurements_selected(measurements_index_t index);
+measurements_index_t measurements_selected_count();
 bool measurements_pack(bp_pack_t *bp);
 bool measurements_put_signature(bp_pack_t *bp, char *id, char *key);
 bool measurements_to_senml(char *buffer, size_t *buffer_size);
+bool measurements_to_senml_compact(char *buffer, size_t *buffer_size);
+bool measurements_to_senml_cbor(char *buffer, size_t *buffer_size);
 bool measurements_to_postman(char *buffer, size_t *buffer_size, char *id, char *key);
+bool measurements_sign_postman(char *buffer, size_t *buffer_size, size_t body_length, char *id, char *key);
 bool measurements_to_template(char *buffer, size_t *buffer_size, char *template_header, char *template_row, char *template_row_separator, char *template_path_separator, char *template_footer);
 bool measurements_append(node_address_t node,           resource_t resource,   device_bus_t bus,
                          device_multiplexer_t multiplexer,  device_channel_t channel,     device_address_t address,
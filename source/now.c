@@ -0,0 +1,86 @@
+// Copyright (c) 2024 José Francisco Castro <me@fran.cc>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <sys/time.h>
+
+#include <esp_log.h>
+#include <esp_sleep.h>
+#include <esp_sntp.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+#include "now.h"
+
+static SemaphoreHandle_t now_mutex = NULL;
+static bool now_set_since_boot = false;
+static int64_t now_shift = 0;           // milliseconds from the clock counting since the cold boot to the wall clock
+static volatile bool now_shifted = false;
+int64_t now_pass = 0;
+
+// The system time counts from the last cold boot until a wall clock arrives, the RTC timer keeps it
+// running during deep sleep. Rows are captured with it and shifted to the wall clock once it is known.
+void now_init()
+{
+    now_mutex = xSemaphoreCreateMutex();
+    if(esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_UNDEFINED) {
+        struct timeval zero_time = { .tv_sec = 0 };   // Reset system time to avoid using the unreliable internal RTC
+        settimeofday(&zero_time, NULL);
+    }
+    ESP_LOGI(__func__, "system time %lli", (long long int) time(NULL));
+}
+
+// The first wall clock of a boot or wake sets the system time, whatever its source: the Date header
+// of any HTTP response or SNTP. Later ones are left to SNTP, which is more precise than a Date header.
+void now_set(struct timeval *wall, bool precise, const char *source)
+{
+    struct timeval before;
+
+    if(wall->tv_sec <= NOW_VALID_MIN)
+        return;
+    xSemaphoreTake(now_mutex, portMAX_DELAY);
+    if(!now_set_since_boot || precise) {
+        gettimeofday(&before, NULL);
+        settimeofday(wall, NULL);
+        if(before.tv_sec <= NOW_VALID_MIN) {
+            now_shift += (wall->tv_sec - before.tv_sec) * 1000LL + (wall->tv_usec - before.tv_usec) / 1000;
+            now_shifted = true;
+        }
+        now_set_since_boot = true;
+        ESP_LOGI(__func__, "System time set to %s: %lli", source, (long long int) wall->tv_sec);
+    }
+    xSemaphoreGive(now_mutex);
+}
+
+// the shift of the rows captured before the clock was set, once
+bool now_take_shift(int64_t *shift)
+{
+    if(!now_shifted)
+        return false;
+    xSemaphoreTake(now_mutex, portMAX_DELAY);
+    *shift = now_shift;
+    now_shift = 0;
+    now_shifted = false;
+    xSemaphoreGive(now_mutex);
+    return true;
+}
+
+// milliseconds of the wall clock, or since the last cold boot if it was not set yet
+int64_t now_millis()
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return now.tv_sec * 1000LL + now.tv_usec / 1000;
+}
+
+// All the rows of a measurement pass share one timestamp, taken when the pass starts
+void now_snapshot()
+{
+    now_pass = now_millis();
+}
+
+// replaces the weak one of ESP-IDF, so that SNTP goes through now_set() too
+void sntp_sync_time(struct timeval *tv)
+{
+    now_set(tv, true, "SNTP");
+    sntp_set_sync_status(SNTP_SYNC_STATUS_COMPLETED);
+}
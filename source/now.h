@@ -4,8 +4,29 @@
 #ifndef now_h
 #define now_h
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <time.h>
+#include <sys/time.h>
 
-#define NOW (time(NULL) > 1680000000 ? time(NULL) : 0)
+#define NOW_VALID_MIN		1680000000		// earlier clocks were not set and count from the last cold boot
+#define NOW_VALID_MIN_MS	(NOW_VALID_MIN * 1000LL)
+
+#define NOW		now_wall()			// seconds, 0 if the clock was not set yet
+#define NOW_MS	now_pass			// milliseconds, the snapshot of the current measurement pass
+
+extern int64_t now_pass;
+
+void now_init();
+void now_set(struct timeval *wall, bool precise, const char *source);
+bool now_take_shift(int64_t *shift);
+int64_t now_millis();
+void now_snapshot();
+
+static inline time_t now_wall()
+{
+    time_t now = time(NULL);
+    return now > NOW_VALID_MIN ? now : 0;
+}
 
 #endif
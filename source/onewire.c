@@ -523,7 +523,7 @@ bool onewire_measure_ds18b20(devices_index_t device)
     float temperature = (((int16_t)scratchpad[1] << 8) | scratchpad[0])  / 16.0f;
 
     ESP_LOGI(__func__, "%f C", temperature);
-    return measurements_append_from_device(device, 0, METRIC_Temperature, NOW, UNIT_Cel, temperature);
+    return measurements_append_from_device(device, 0, METRIC_Temperature, NOW_MS, UNIT_Cel, temperature);
 }
 
 
@@ -564,6 +564,6 @@ bool onewire_measure_tmp1826(devices_index_t device)
     float temperature = (((int16_t)scratchpad[1] << 8) | scratchpad[0])  / 16.0f;
 
     ESP_LOGI(__func__, "%f C", temperature);
-    return measurements_append_from_device(device, 0, METRIC_Temperature, NOW, UNIT_Cel, temperature);
+    return measurements_append_from_device(device, 0, METRIC_Temperature, NOW_MS, UNIT_Cel, temperature);
 }
 
@@ -3,6 +3,7 @@
 
 #include <stdio.h>
 #include <stdarg.h>
+#include <string.h>
 
 #include "pbuf.h"
 
@@ -33,3 +34,14 @@ bool pbuf_putc(pbuf_t *buffer, char c)
     buffer->data[buffer->length] = 0;
     return true;
 }
+
+bool pbuf_put(pbuf_t *buffer, const char *data, size_t length)
+{
+    if(buffer->length + length >= buffer->size)
+        return false;
+
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+    buffer->data[buffer->length] = 0;
+    return true;
+}
@@ -14,5 +14,6 @@ typedef struct {
 
 bool pbuf_printf(pbuf_t *buffer, const char *format, ...);
 bool pbuf_putc(pbuf_t *buffer, char c);
+bool pbuf_put(pbuf_t *buffer, const char *data, size_t length);
 
 #endif
\ No newline at end of file
@@ -1,10 +1,12 @@
 #include <esp_log.h>
 
 #include "adc.h"
+#include "alarms.h"
 #include "application.h"
 #include "ble.h"
 #include "board.h"
 #include "backends.h"
+#include "deadbands.h"
 #include "devices.h"
 #include "i2c.h"
 #include "logs.h"
@@ -45,10 +47,12 @@ uint32_t schema_resource_handler(uint32_t method, bp_pack_t *reader, bp_pack_t *
         ok = ok && bp_create_container(writer, BP_LIST);
         	ok = ok && root_schema_handler(writer);
         	ok = ok && adc_schema_handler("adc", writer);
+        	ok = ok && alarms_schema_handler("alarms", writer);
         	ok = ok && application_schema_handler("application", writer);
         	ok = ok && ble_schema_handler("ble", writer);
         	ok = ok && board_schema_handler("board", writer);
         	ok = ok && backends_schema_handler("backends", writer);
+        	ok = ok && deadbands_schema_handler("deadbands", writer);
         	ok = ok && devices_schema_handler("devices", writer);
         	ok = ok && i2c_schema_handler("i2c", writer);
         	ok = ok && logs_schema_handler("logs", writer);
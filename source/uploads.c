@@ -0,0 +1,1143 @@
+// Copyright (c) 2024 José Francisco Castro <me@fran.cc>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <stdalign.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <esp_log.h>
+#include <esp_random.h>
+#include <esp_timer.h>
+#include <esp_crt_bundle.h>
+#include <esp_rom_md5.h>
+#include <mbedtls/base64.h>
+#include <mbedtls/ssl.h>
+#include <nvs_flash.h>
+#include <freertos/semphr.h>
+
+#include "application.h"
+#include "backends.h"
+#include "cbor.h"
+#include "enums.h"
+#include "hmac.h"
+#include "httpdate.h"
+#include "measurements.h"
+#include "now.h"
+#include "postman.h"
+#include "sha256.h"
+#include "uploads.h"
+#include "wifi.h"
+
+#ifndef MIN
+#define MIN(a,b) (((a)<(b))?(a):(b))
+#endif
+
+extern postman_t postman;
+
+uploads_worker_t uploads_workers[BACKENDS_NUM_MAX] = {{0}};
+SemaphoreHandle_t uploads_mutex = NULL;
+RTC_DATA_ATTR uint32_t uploads_digest_nc[BACKENDS_NUM_MAX] = {0};     // requests sent with the cached nonce
+#ifdef CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+RTC_DATA_ATTR uint8_t uploads_tls_session[BACKENDS_NUM_MAX][UPLOADS_TLS_SESSION_LENGTH];
+RTC_DATA_ATTR size_t uploads_tls_session_length[BACKENDS_NUM_MAX] = {0};     // none saved if 0
+#endif
+
+int8_t uploads_payload_backend = -1;        // backend whose unsigned encoding is in uploads_payload, -1 if none
+size_t uploads_payload_body_length = 0;
+alignas(4) char uploads_payload[UPLOADS_BUFFER_LENGTH];
+
+void uploads_init()
+{
+    nvs_handle_t handle;
+    char nvs_key[16];
+    size_t length;
+
+    uploads_mutex = xSemaphoreCreateMutex();
+    if(!nvs_open("uploads", NVS_READWRITE, &handle)) {
+        for(uint8_t i = 0; i < BACKENDS_NUM_MAX; i++) {
+            snprintf(nvs_key, sizeof(nvs_key), "%u_digest", i);
+            length = sizeof(uploads_digest_t);
+            if(nvs_get_blob(handle, nvs_key, &uploads_workers[i].digest, &length) || length != sizeof(uploads_digest_t))
+                memset(&uploads_workers[i].digest, 0, sizeof(uploads_digest_t));
+        }
+        nvs_close(handle);
+    }
+    ESP_LOGI(__func__, "%s", uploads_mutex ? "done" : "failed");
+}
+
+// serializes the access to measurements, backends and postman between the main loop and the workers
+void uploads_lock()
+{
+    xSemaphoreTake(uploads_mutex, portMAX_DELAY);
+}
+
+void uploads_unlock()
+{
+    xSemaphoreGive(uploads_mutex);
+}
+
+void uploads_clear_payload()
+{
+    uploads_payload_backend = -1;
+}
+
+// encodes the ring for a backend into uploads_payload, postman batches are signed if sign is set
+size_t uploads_encode(uint8_t backend, bool sign)
+{
+    bool ok = true;
+    size_t length = sizeof(uploads_payload);
+
+    measurements_resolve();
+    measurements_select(backend);
+    bool filtered_out = backends[backend].filters_count && (measurements_count || measurements_full) && !measurements_selected_count();
+    measurements_select(-1);
+    if(filtered_out) {
+        ESP_LOGI(__func__, "no rows pass the filter of backend %i", backend);
+        return 0;
+    }
+
+    if(uploads_payload_backend >= 0 && backends_share_encoding(uploads_payload_backend, backend)) {
+        ESP_LOGI(__func__, "reusing payload encoded for backend %i", uploads_payload_backend);
+        length = uploads_payload_body_length;
+    }
+    else {
+        uploads_payload_backend = -1;
+        measurements_select(backend);
+        switch(backends[backend].format) {
+            case BACKEND_FORMAT_SENML:
+                ok = ok && measurements_to_senml(uploads_payload, &length);
+                break;
+            case BACKEND_FORMAT_SENML_COMPACT:
+                ok = ok && measurements_to_senml_compact(uploads_payload, &length);
+                break;
+            case BACKEND_FORMAT_SENML_CBOR:
+                ok = ok && measurements_to_senml_cbor(uploads_payload, &length);
+                break;
+            case BACKEND_FORMAT_POSTMAN:
+                ok = ok && measurements_to_postman(uploads_payload, &length, NULL, NULL);
+                break;
+            case BACKEND_FORMAT_TEMPLATE:
+                ok = ok && measurements_to_template(uploads_payload, &length,
+                    backends[backend].template_header, backends[backend].template_row,
+                    backends[backend].template_row_separator, backends[backend].template_path_separator,
+                    backends[backend].template_footer);
+                break;
+            default:
+                ok = false;
+        }
+        measurements_select(-1);
+        if(ok) {
+            uploads_payload_backend = backend;
+            uploads_payload_body_length = length;
+        }
+    }
+
+    // the signature is the only part that differs between backends sharing the encoding
+    if(ok && sign && backends[backend].format == BACKEND_FORMAT_POSTMAN && backends[backend].auth == BACKEND_AUTH_POSTMAN) {
+        length = sizeof(uploads_payload);
+        ok = ok && measurements_sign_postman(uploads_payload, &length, uploads_payload_body_length,
+            backends[backend].user, backends[backend].key);
+    }
+
+    ESP_LOGI(__func__, "payload buffer length / size: %u / %u", length, sizeof(uploads_payload));
+
+    if(!ok && !length)
+        ESP_LOGE(__func__, "payload buffer overflow!");
+
+    if(!ok) {
+        backends[backend].status = BACKEND_STATUS_ERROR;
+        backends[backend].error = 0x201; // Serialization failed
+        backends[backend].message[0] = 0;
+        length = 0;
+    }
+    return length;
+}
+
+// Encodes the row at ring position n, or the group or batch starting there, as a message of its own.
+// Returns the rows consumed, buf is left empty if there is nothing to send. Called with the filter of
+// the backend selected and the uploads lock held.
+measurements_index_t uploads_encode_row(uint8_t backend, int n, int count, pbuf_t *buf)
+{
+    measurements_index_t index = measurements_full ? (measurements_count + n) % MEASUREMENTS_NUM_MAX : n;
+    measurements_index_t length = 1;
+
+    switch(backends[backend].format) {
+    case BACKEND_FORMAT_SENML:
+    case BACKEND_FORMAT_SENML_COMPACT:     // a single row gains nothing from base fields
+        if(!measurements_entry_to_senml_row(index, buf))
+            buf->length = 0;
+        break;
+    case BACKEND_FORMAT_SENML_CBOR:
+        if(!cbor_put_array(buf, 1) || !measurements_entry_to_senml_cbor_row(index, buf))
+            buf->length = 0;
+        break;
+    case BACKEND_FORMAT_POSTMAN:
+        buf->length = buf->size;
+        measurements_entry_to_postman(index, buf->data, &buf->length,
+            backends[backend].auth == BACKEND_AUTH_POSTMAN ? backends[backend].user : NULL,
+            backends[backend].auth == BACKEND_AUTH_POSTMAN ? backends[backend].key : NULL);
+        break;
+    case BACKEND_FORMAT_TEMPLATE:
+        if(measurements_template_is_wide(backends[backend].template_row)) {    // one message per device and timestamp
+            length = measurements_group_length(n, count);
+            measurements_group_to_template_row(index, length, buf, backends[backend].template_row, backends[backend].template_path_separator);
+        }
+        else
+            measurements_entry_to_template_row(index, buf, backends[backend].template_row, backends[backend].template_path_separator);
+        break;
+    case BACKEND_FORMAT_BATCH:
+        length = measurements_to_batch(n, count, backend, buf);
+        if(!length) {
+            length = 1;
+            buf->length = 0;
+        }
+        break;
+    case BACKEND_FORMAT_FRAME:
+        buf->length = sizeof(measurement_frame_t);
+        if(!measurements_entry_to_frame(index, (measurement_frame_t *) buf->data))
+            buf->length = 0;    // aggregates cannot be told apart from samples in a frame
+        break;
+    default:
+        backends[backend].status = BACKEND_STATUS_ERROR;
+        backends[backend].error = ESP_ERR_INVALID_ARG;
+        strlcpy(backends[backend].message, "Unsupported format", sizeof(backends[backend].message));
+        ESP_LOGE(__func__, "Unsupported format at backend %i", backend);
+        buf->length = 0;
+        break;
+    }
+    return length;
+}
+
+static esp_err_t uploads_http_event_handler(esp_http_client_event_t *event)
+{
+    uploads_worker_t *worker = event->user_data;
+    struct timeval timestamp = { 0 };
+
+    switch(event->event_id) {
+        case HTTP_EVENT_ON_CONNECTED:
+             worker->response_length = 0;
+             break;
+        case HTTP_EVENT_ON_HEADER:
+            if(!strncmp(event->header_key, "Date", 5) && httpdate_parse(event->header_value, &timestamp.tv_sec))
+                now_set(&timestamp, false, "HTTP Date");     // from any response of any backend, the first one wins
+            else if(!strcasecmp(event->header_key, "WWW-Authenticate") && !strncasecmp(event->header_value, "Digest ", 7))
+                strlcpy(worker->challenge, event->header_value, sizeof(worker->challenge));
+            break;
+        case HTTP_EVENT_ON_DATA:
+            if (worker->response && !esp_http_client_is_chunked_response(event->client)) {
+                size_t copy_len = MIN(event->data_len, (UPLOADS_BUFFER_LENGTH - 1 - worker->response_length));
+                if(copy_len)
+                    memcpy(worker->response + worker->response_length, event->data, copy_len);
+                worker->response_length += copy_len;
+            }
+            break;
+        default:
+            break;
+    }
+    return ESP_OK;
+}
+
+static const char *uploads_content_type(uint8_t i)
+{
+    if(backends[i].content_type[0])
+        return backends[i].content_type;
+    switch(backends[i].format) {
+        case BACKEND_FORMAT_SENML:
+        case BACKEND_FORMAT_SENML_COMPACT:
+            return "application/json";
+        case BACKEND_FORMAT_SENML_CBOR:
+            return "application/senml+cbor";
+        case BACKEND_FORMAT_POSTMAN:
+            return "application/vnd.postman";
+        case BACKEND_FORMAT_TEMPLATE:
+            return "text/plain; charset=utf-8";
+    }
+    return NULL;
+}
+
+static esp_http_client_handle_t uploads_http_open(uint8_t i)
+{
+    uploads_worker_t *worker = &uploads_workers[i];
+    esp_http_client_config_t config_post = {
+        .url = backends[i].uri,
+        .max_authorization_retries = backends[i].auth == BACKEND_AUTH_DIGEST ? -1 : 0,     // challenges are answered here
+        .cert_pem = backends[i].server_cert[0] ? backends[i].server_cert : NULL,
+        .crt_bundle_attach = backends[i].server_cert[0] ? NULL : esp_crt_bundle_attach,
+        .is_async = false,
+        .timeout_ms = UPLOADS_TIMEOUT,
+        .keep_alive_enable = true,
+        .event_handler = uploads_http_event_handler,
+        .user_data = worker,
+    };
+
+    esp_http_client_handle_t client = esp_http_client_init(&config_post);
+    if(!client)
+        return NULL;
+
+    switch(backends[i].auth) {
+        case BACKEND_AUTH_BASIC:
+            esp_http_client_set_authtype(client, HTTP_AUTH_TYPE_BASIC);
+            esp_http_client_set_username(client, backends[i].user);
+            esp_http_client_set_password(client, backends[i].key);
+            break;
+        case BACKEND_AUTH_DIGEST:       // the Authorization header is set before each request from the cached challenge
+            break;
+        case BACKEND_AUTH_BEARER:
+        case BACKEND_AUTH_TOKEN: {      // the response buffer may hold a pending postman reply
+            size_t length = strlen(backends[i].key) + sizeof("Bearer ");
+            char *authorization = malloc(length);
+            if(authorization) {
+                snprintf(authorization, length, "%s %s", backends[i].auth == BACKEND_AUTH_BEARER ? "Bearer" : "Token", backends[i].key);
+                esp_http_client_set_header(client, "Authorization", authorization);
+                free(authorization);
+            }
+            break;
+        }
+        case BACKEND_AUTH_HEADER:
+            esp_http_client_set_header(client, backends[i].user, backends[i].key);
+            break;
+    }
+
+    const char *content_type = uploads_content_type(i);
+    if(content_type)
+        esp_http_client_set_header(client, "Content-Type", content_type);
+
+    worker->epoch = backends_epoch;
+    ESP_LOGI(__func__, "HTTP client for backend %i created", i);
+    return client;
+}
+
+static void uploads_http_close(uint8_t i)
+{
+    if(uploads_workers[i].client)
+        esp_http_client_cleanup(uploads_workers[i].client);
+    if(uploads_workers[i].tls)
+        esp_tls_conn_destroy(uploads_workers[i].tls);
+    uploads_workers[i].client = NULL;
+    uploads_workers[i].tls = NULL;
+}
+
+// copies the value of a parameter of a WWW-Authenticate header, quoted or not
+static bool uploads_digest_param(const char *header, const char *name, char *value, size_t size)
+{
+    size_t length = strlen(name);
+    const char *p = header + sizeof("Digest ") - 1;
+
+    while(p && *p) {
+        while(*p == ' ' || *p == ',')
+            p++;
+        bool found = !strncasecmp(p, name, length) && p[length] == '=';
+        if(!(p = strchr(p, '=')))
+            break;
+        p++;
+        bool quoted = *p == '"';
+        const char *start = p + quoted;
+        const char *end = quoted ? strchr(start, '"') : start + strcspn(start, ", ");
+        if(!end)
+            break;
+        if(found) {
+            if(end - start >= size)
+                break;
+            memcpy(value, start, end - start);
+            value[end - start] = 0;
+            return true;
+        }
+        p = end + quoted;
+    }
+    return false;
+}
+
+// caches the challenge of the last response and restarts the nonce count
+static bool uploads_digest_parse(uint8_t i)
+{
+    uploads_worker_t *worker = &uploads_workers[i];
+    uploads_digest_t digest = {0};
+    char value[32];
+    char *state;
+    bool ok = true;
+
+    ok = ok && uploads_digest_param(worker->challenge, "realm", digest.realm, sizeof(digest.realm));
+    ok = ok && uploads_digest_param(worker->challenge, "nonce", digest.nonce, sizeof(digest.nonce));
+    uploads_digest_param(worker->challenge, "opaque", digest.opaque, sizeof(digest.opaque));
+    if(uploads_digest_param(worker->challenge, "qop", value, sizeof(value)))
+        for(char *qop = strtok_r(value, ", ", &state); qop; qop = strtok_r(NULL, ", ", &state))
+            digest.qop = digest.qop || !strcmp(qop, "auth");
+    if(uploads_digest_param(worker->challenge, "algorithm", value, sizeof(value))) {
+        digest.sha256 = !strcasecmp(value, "SHA-256");
+        ok = ok && (digest.sha256 || !strcasecmp(value, "MD5"));
+    }
+    if(!ok) {
+        ESP_LOGE(__func__, "unsupported digest challenge from backend %i: %s", i, worker->challenge);
+        return false;
+    }
+
+    bool changed = strcmp(digest.realm, worker->digest.realm) || strcmp(digest.nonce, worker->digest.nonce) ||
+                   strcmp(digest.opaque, worker->digest.opaque);
+    worker->digest = digest;
+    uploads_digest_nc[i] = 0;
+    if(!changed)        // spares the flash a write for a challenge repeated after a rejected response
+        return true;
+
+    nvs_handle_t handle;
+    char nvs_key[16];
+    if(!nvs_open("uploads", NVS_READWRITE, &handle)) {
+        snprintf(nvs_key, sizeof(nvs_key), "%u_digest", i);
+        ok = ok && !nvs_set_blob(handle, nvs_key, &worker->digest, sizeof(uploads_digest_t));
+        ok = ok && !nvs_commit(handle);
+        nvs_close(handle);
+    }
+    ESP_LOGI(__func__, "new nonce for backend %i %s", i, ok ? "saved" : "not saved");
+    return true;
+}
+
+// hex of the hash of the parts joined by colons, as RFC 7616 builds A1, A2 and the response
+static void uploads_digest_hash(bool sha256, char *hex, int count, const char *parts[])
+{
+    uint8_t hash[SHA256_SIZE_BYTES];
+    size_t size;
+
+    if(sha256) {
+        sha256_context context;
+        sha256_init(&context);
+        for(int k = 0; k < count; k++) {
+            if(k)
+                sha256_hash(&context, ":", 1);
+            sha256_hash(&context, parts[k], strlen(parts[k]));
+        }
+        sha256_done(&context, hash);
+        size = SHA256_SIZE_BYTES;
+    }
+    else {
+        md5_context_t context;
+        esp_rom_md5_init(&context);
+        for(int k = 0; k < count; k++) {
+            if(k)
+                esp_rom_md5_update(&context, ":", 1);
+            esp_rom_md5_update(&context, parts[k], strlen(parts[k]));
+        }
+        esp_rom_md5_final(hash, &context);
+        size = ESP_ROM_MD5_DIGEST_LEN;
+    }
+    for(size_t k = 0; k < size; k++)
+        sprintf(hex + 2 * k, "%02x", hash[k]);
+}
+
+// answers the cached challenge without waiting for a 401, with the next nonce count
+static char *uploads_digest_authorize(uint8_t i, esp_http_client_method_t method)
+{
+    uploads_digest_t *digest = &uploads_workers[i].digest;
+    const char *method_name = method == HTTP_METHOD_POST ? "POST" : method == HTTP_METHOD_HEAD ? "HEAD" : "GET";
+    const char *uri = strstr(backends[i].uri, "://");
+    char nc[9], cnonce[17], ha1[65], ha2[65], response[65];
+
+    uri = uri ? strchr(uri + 3, '/') : NULL;
+    if(!uri)
+        uri = "/";
+    snprintf(nc, sizeof(nc), "%08lx", (unsigned long) ++uploads_digest_nc[i]);
+    snprintf(cnonce, sizeof(cnonce), "%08lx%08lx", (unsigned long) esp_random(), (unsigned long) esp_random());
+
+    uploads_digest_hash(digest->sha256, ha1, 3, (const char *[]) { backends[i].user, digest->realm, backends[i].key });
+    uploads_digest_hash(digest->sha256, ha2, 2, (const char *[]) { method_name, uri });
+    if(digest->qop)
+        uploads_digest_hash(digest->sha256, response, 6, (const char *[]) { ha1, digest->nonce, nc, cnonce, "auth", ha2 });
+    else
+        uploads_digest_hash(digest->sha256, response, 3, (const char *[]) { ha1, digest->nonce, ha2 });
+
+    size_t length = strlen(backends[i].user) + strlen(digest->realm) + strlen(digest->nonce) + strlen(uri) +
+                    strlen(digest->opaque) + sizeof(response) + 192;
+    char *authorization = malloc(length);
+    if(!authorization)
+        return NULL;
+    int n = snprintf(authorization, length, "Digest username=\"%s\", realm=\"%s\", nonce=\"%s\", uri=\"%s\", algorithm=%s, response=\"%s\"",
+                     backends[i].user, digest->realm, digest->nonce, uri, digest->sha256 ? "SHA-256" : "MD5", response);
+    if(digest->qop)
+        n += snprintf(authorization + n, length - n, ", qop=auth, nc=%s, cnonce=\"%s\"", nc, cnonce);
+    if(digest->opaque[0])
+        snprintf(authorization + n, length - n, ", opaque=\"%s\"", digest->opaque);
+    return authorization;
+}
+
+#ifdef CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+// esp_tls_client_session_t only wraps an mbedtls_ssl_session, so the saved one is loaded in its place
+static esp_tls_client_session_t *uploads_tls_load_session(uint8_t i)
+{
+    if(!uploads_tls_session_length[i])
+        return NULL;
+    mbedtls_ssl_session *session = malloc(sizeof(mbedtls_ssl_session));
+    if(!session)
+        return NULL;
+    mbedtls_ssl_session_init(session);
+    if(mbedtls_ssl_session_load(session, uploads_tls_session[i], uploads_tls_session_length[i])) {
+        mbedtls_ssl_session_free(session);
+        free(session);
+        uploads_tls_session_length[i] = 0;
+        return NULL;
+    }
+    return (esp_tls_client_session_t *) session;
+}
+
+// a session the server does not know anymore, or from a previous URI, just ends in a full handshake
+static void uploads_tls_save_session(uint8_t i)
+{
+    esp_tls_client_session_t *session = esp_tls_get_client_session(uploads_workers[i].tls);
+    size_t length = 0;
+
+    if(!session || mbedtls_ssl_session_save((mbedtls_ssl_session *) session, uploads_tls_session[i], UPLOADS_TLS_SESSION_LENGTH, &length))
+        length = 0;
+    uploads_tls_session_length[i] = length;
+    if(session)
+        esp_tls_free_client_session(session);
+    ESP_LOGI(__func__, "TLS session of backend %i %s, %u bytes", i, length ? "saved" : "not saved", length);
+}
+#endif
+
+static bool uploads_tls_open(uint8_t i, int timeout)
+{
+    uploads_worker_t *worker = &uploads_workers[i];
+    esp_tls_cfg_t config = {
+        .timeout_ms = timeout,
+    };
+    bool ok = true;
+
+    uploads_lock();     // copied, a PUT to the backend may be rewriting its settings while connecting
+    char *uri = strdup(backends[i].uri);
+    char *cert = backends[i].server_cert[0] ? strdup(backends[i].server_cert) : NULL;
+    ok = ok && uri && (cert || !backends[i].server_cert[0]);
+    worker->epoch = backends_epoch;
+    uploads_unlock();
+
+    if(cert) {
+        config.cacert_buf = (const unsigned char *) cert;
+        config.cacert_bytes = strlen(cert) + 1;
+    }
+    else
+        config.crt_bundle_attach = esp_crt_bundle_attach;
+#ifdef CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+    esp_tls_client_session_t *session = ok ? uploads_tls_load_session(i) : NULL;
+    config.client_session = session;
+#else
+    void *session = NULL;
+#endif
+
+    int64_t start = esp_timer_get_time();
+    ok = ok && (worker->tls = esp_tls_init());
+    ok = ok && esp_tls_conn_http_new_sync(uri, &config, worker->tls) == 1;
+    ESP_LOGI(__func__, "TLS connection to backend %i %s in %lli ms, %s", i, ok ? "opened" : "failed",
+             (esp_timer_get_time() - start) / 1000, session ? "resuming the saved session" : "with a full handshake");
+    if(!ok && worker->tls) {
+        esp_tls_conn_destroy(worker->tls);
+        worker->tls = NULL;
+    }
+
+#ifdef CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+    if(session)
+        esp_tls_free_client_session(session);
+#endif
+    free(cert);
+    free(uri);
+    return ok;
+}
+
+// the request line and headers, with the same ones uploads_http_open sets on a client
+static char *uploads_tls_request(uint8_t i, esp_http_client_method_t method, size_t length, const char *authorization, size_t *request_length)
+{
+    uploads_lock();
+    const char *host = strstr(backends[i].uri, "://");
+    host = host ? host + 3 : backends[i].uri;
+    int host_length = strcspn(host, "/");
+    const char *path = host[host_length] ? host + host_length : "/";
+    const char *content_type = uploads_content_type(i);
+    size_t size = strlen(backends[i].uri) + 2 * (strlen(backends[i].user) + strlen(backends[i].key)) + 256 +
+                  (content_type ? strlen(content_type) : 0) + (authorization ? strlen(authorization) : 0);
+    char *request = malloc(size);
+    if(!request) {
+        uploads_unlock();
+        return NULL;
+    }
+
+    int n = snprintf(request, size, "%s %s HTTP/1.1\r\nHost: %.*s\r\n", method == HTTP_METHOD_POST ? "POST" : method == HTTP_METHOD_HEAD ? "HEAD" : "GET",
+                     path, host_length, host);
+    if(method == HTTP_METHOD_POST) {
+        n += snprintf(request + n, size - n, "Content-Length: %u\r\n", length);
+        if(content_type)
+            n += snprintf(request + n, size - n, "Content-Type: %s\r\n", content_type);
+    }
+    switch(backends[i].auth) {
+        case BACKEND_AUTH_BASIC: {
+            size_t encoded = 0;
+            size_t credentials_length = strlen(backends[i].user) + strlen(backends[i].key) + 2;
+            char *credentials = malloc(credentials_length);
+            if(credentials) {
+                snprintf(credentials, credentials_length, "%s:%s", backends[i].user, backends[i].key);
+                n += snprintf(request + n, size - n, "Authorization: Basic ");
+                if(mbedtls_base64_encode((unsigned char *) request + n, size - n, &encoded, (unsigned char *) credentials, strlen(credentials)))
+                    encoded = 0;
+                n += encoded;
+                n += snprintf(request + n, size - n, "\r\n");
+                free(credentials);
+            }
+            break;
+        }
+        case BACKEND_AUTH_DIGEST:
+            if(authorization)
+                n += snprintf(request + n, size - n, "Authorization: %s\r\n", authorization);
+            break;
+        case BACKEND_AUTH_BEARER:
+        case BACKEND_AUTH_TOKEN:
+            n += snprintf(request + n, size - n, "Authorization: %s %s\r\n", backends[i].auth == BACKEND_AUTH_BEARER ? "Bearer" : "Token", backends[i].key);
+            break;
+        case BACKEND_AUTH_HEADER:
+            n += snprintf(request + n, size - n, "%s: %s\r\n", backends[i].user, backends[i].key);
+            break;
+    }
+    n += snprintf(request + n, size - n, "\r\n");
+    uploads_unlock();
+
+    *request_length = n;
+    return request;
+}
+
+static bool uploads_tls_write(esp_tls_t *tls, const char *data, size_t length)
+{
+    while(length) {
+        ssize_t n = esp_tls_conn_write(tls, data, length);
+        if(n <= 0)
+            return false;
+        data += n;
+        length -= n;
+    }
+    return true;
+}
+
+// like uploads_http_event_handler, the body is kept up to the size of the response buffer
+static void uploads_tls_keep(uploads_worker_t *worker, const char *data, size_t length)
+{
+    size_t copy_len = worker->response ? MIN(length, (UPLOADS_BUFFER_LENGTH - 1 - worker->response_length)) : 0;
+    if(copy_len)
+        memcpy(worker->response + worker->response_length, data, copy_len);
+    worker->response_length += copy_len;
+}
+
+// reads the status, the headers the event handler looks at and the body, keep is cleared if the connection
+// cannot be reused, as chunked bodies are skipped instead of parsed
+static bool uploads_tls_response(uint8_t i, bool head, bool *keep)
+{
+    uploads_worker_t *worker = &uploads_workers[i];
+    char *headers = malloc(UPLOADS_HEADERS_LENGTH);
+    char *body = NULL;
+    size_t count = 0;
+    struct timeval timestamp = { 0 };
+    char *state;
+
+    if(!headers)
+        return false;
+    while(!body) {
+        ssize_t n = count < UPLOADS_HEADERS_LENGTH - 1 ? esp_tls_conn_read(worker->tls, headers + count, UPLOADS_HEADERS_LENGTH - 1 - count) : -1;
+        if(n <= 0) {
+            free(headers);
+            return false;
+        }
+        count += n;
+        headers[count] = 0;
+        if((body = strstr(headers, "\r\n\r\n"))) {
+            *body = 0;
+            body += 4;
+        }
+    }
+
+    char *line = strtok_r(headers, "\r\n", &state);
+    char *status = line ? strchr(line, ' ') : NULL;
+    worker->status = status ? strtol(status, NULL, 10) : 0;
+    long content_length = -1;
+    *keep = true;
+    while((line = strtok_r(NULL, "\r\n", &state))) {
+        char *value = strchr(line, ':');
+        if(!value)
+            continue;
+        *value++ = 0;
+        while(*value == ' ')
+            value++;
+        if(!strcasecmp(line, "Date") && httpdate_parse(value, &timestamp.tv_sec))
+            now_set(&timestamp, false, "HTTP Date");
+        else if(!strcasecmp(line, "WWW-Authenticate") && !strncasecmp(value, "Digest ", 7))
+            strlcpy(worker->challenge, value, sizeof(worker->challenge));
+        else if(!strcasecmp(line, "Content-Length"))
+            content_length = strtol(value, NULL, 10);
+        else if(!strcasecmp(line, "Transfer-Encoding") && strcasecmp(value, "identity"))
+            *keep = false;
+        else if(!strcasecmp(line, "Connection") && !strcasecmp(value, "close"))
+            *keep = false;
+    }
+
+    bool bodyless = head || worker->status < 200 || worker->status == 204 || worker->status == 304;
+    if(!bodyless && *keep) {        // until the connection is closed if there is no length
+        size_t left = content_length >= 0 ? content_length : SIZE_MAX;
+        size_t n = MIN(left, headers + count - body);
+        uploads_tls_keep(worker, body, n);
+        for(left -= n; left; left -= n) {
+            ssize_t read = esp_tls_conn_read(worker->tls, headers, MIN(left, UPLOADS_HEADERS_LENGTH));
+            if(read <= 0)
+                break;
+            uploads_tls_keep(worker, headers, n = read);
+        }
+        *keep = left == 0;
+    }
+    free(headers);
+    return worker->status != 0;
+}
+
+// HTTP/1.1 straight over esp_tls, as esp_http_client offers no way to resume a TLS session
+static esp_err_t uploads_tls_perform(uint8_t i, esp_http_client_method_t method, char *data, size_t length, const char *authorization, int timeout)
+{
+    uploads_worker_t *worker = &uploads_workers[i];
+    bool opened = !worker->tls;
+    bool keep = false;
+    size_t request_length;
+    int fd;
+
+    if(opened && !uploads_tls_open(i, timeout))
+        return ESP_ERR_HTTP_CONNECT;
+    if(!opened && esp_tls_get_conn_sockfd(worker->tls, &fd) == ESP_OK) {       // the wake budget left for this request
+        struct timeval limit = { .tv_sec = timeout / 1000, .tv_usec = timeout % 1000 * 1000 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &limit, sizeof(limit));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &limit, sizeof(limit));
+    }
+
+    char *request = uploads_tls_request(i, method, length, authorization, &request_length);
+    if(!request)
+        return ESP_ERR_NO_MEM;
+    bool ok = uploads_tls_write(worker->tls, request, request_length) && uploads_tls_write(worker->tls, data, length);
+    free(request);
+    if(!ok)
+        return ESP_ERR_HTTP_WRITE_DATA;
+    if(!uploads_tls_response(i, method == HTTP_METHOD_HEAD, &keep))
+        return ESP_ERR_HTTP_FETCH_HEADER;
+
+#ifdef CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+    if(opened)      // after a response, as TLS 1.3 tickets arrive after the handshake
+        uploads_tls_save_session(i);
+#endif
+    if(!keep)
+        uploads_http_close(i);
+    return ESP_OK;
+}
+
+static esp_err_t uploads_http_perform(uint8_t i, esp_http_client_method_t method, char *data, size_t length)
+{
+    uploads_worker_t *worker = &uploads_workers[i];
+    esp_err_t err = ESP_ERR_INVALID_ARG;
+    bool reused = true;
+    bool challenged = false;
+    bool retry = true;
+    bool digest;
+
+    while(retry) {      // the server may have closed an idle connection, retry once on a new one
+        retry = false;
+        uploads_lock();
+        bool direct = backends[i].tls_resumption && !strncmp(backends[i].uri, "https://", 8);
+        uploads_unlock();
+        reused = direct ? worker->tls != NULL : worker->client != NULL;
+        if(!reused && !direct) {
+            uploads_lock();
+            worker->client = uploads_http_open(i);
+            uploads_unlock();
+            if(!worker->client)
+                return ESP_ERR_INVALID_ARG;
+        }
+
+        int64_t time_left = application_time_left() / 1000;
+        if(time_left < UPLOADS_TIME_LEFT_MIN)
+            return ESP_ERR_TIMEOUT;
+
+        uploads_lock();     // a PUT to the backend may be rewriting its settings
+        digest = backends[i].auth == BACKEND_AUTH_DIGEST;
+        char *authorization = digest && worker->digest.nonce[0] ? uploads_digest_authorize(i, method) : NULL;
+        uploads_unlock();
+        worker->response_length = 0;
+        worker->challenge[0] = 0;
+        if(direct)
+            err = uploads_tls_perform(i, method, data, length, authorization, MIN(time_left, UPLOADS_TIMEOUT));
+        else {
+            esp_http_client_set_timeout_ms(worker->client, MIN(time_left, UPLOADS_TIMEOUT));
+            esp_http_client_set_method(worker->client, method);
+            esp_http_client_set_post_field(worker->client, data, length);     // clears the previous body too
+            if(authorization)
+                esp_http_client_set_header(worker->client, "Authorization", authorization);
+            err = esp_http_client_perform(worker->client);
+            worker->status = err == ESP_OK ? esp_http_client_get_status_code(worker->client) : 0;
+        }
+        free(authorization);
+        if(err != ESP_OK) {
+            uploads_http_close(i);
+            retry = reused;
+        }
+        else if(digest && !challenged && worker->challenge[0] && worker->status == 401 && uploads_digest_parse(i)) {
+            challenged = true;      // no nonce yet or a stale one, answered once with the new one
+            retry = true;
+        }
+    }
+    return err;
+}
+
+// takes the oldest batch out of the outbox, the worker sends it without holding the lock
+static bool uploads_outbox_take(uint8_t i, uploads_batch_t *batch)
+{
+    uploads_worker_t *worker = &uploads_workers[i];
+
+    if(!worker->outbox_count)
+        return false;
+    *batch = worker->outbox[worker->outbox_first];
+    worker->outbox[worker->outbox_first].data = NULL;
+    worker->outbox_length -= batch->length;
+    worker->outbox_first = (worker->outbox_first + 1) % UPLOADS_OUTBOX_NUM_MAX;
+    worker->outbox_count--;
+    backends[i].outbox_count = worker->outbox_count;
+    backends[i].outbox_length = worker->outbox_length;
+    return true;
+}
+
+static void uploads_outbox_pop(uint8_t i)
+{
+    uploads_batch_t batch;
+
+    if(uploads_outbox_take(i, &batch))
+        free(batch.data);
+}
+
+// puts a batch that failed back as the oldest one, unless the settings changed or newer ones filled the outbox
+static void uploads_outbox_return(uint8_t i, uploads_batch_t *batch)
+{
+    uploads_worker_t *worker = &uploads_workers[i];
+
+    if(worker->discard || worker->outbox_count == UPLOADS_OUTBOX_NUM_MAX || worker->outbox_length + batch->length > UPLOADS_OUTBOX_LENGTH_MAX) {
+        backends[i].dropped += !worker->discard;
+        free(batch->data);
+        return;
+    }
+    worker->outbox_first = (worker->outbox_first + UPLOADS_OUTBOX_NUM_MAX - 1) % UPLOADS_OUTBOX_NUM_MAX;
+    worker->outbox[worker->outbox_first] = *batch;
+    worker->outbox_length += batch->length;
+    worker->outbox_count++;
+    backends[i].outbox_count = worker->outbox_count;
+    backends[i].outbox_length = worker->outbox_length;
+}
+
+// the oldest batches are dropped to make room for the newest one
+static bool uploads_outbox_push(uint8_t i, char *data, size_t length)
+{
+    uploads_worker_t *worker = &uploads_workers[i];
+
+    if(length > UPLOADS_OUTBOX_LENGTH_MAX)
+        return false;
+    while(worker->outbox_count && (worker->outbox_count == UPLOADS_OUTBOX_NUM_MAX || worker->outbox_length + length > UPLOADS_OUTBOX_LENGTH_MAX)) {
+        uploads_outbox_pop(i);
+        backends[i].dropped++;
+    }
+    uploads_batch_t *batch = &worker->outbox[(worker->outbox_first + worker->outbox_count) % UPLOADS_OUTBOX_NUM_MAX];
+    if(!(batch->data = malloc(length)))
+        return false;
+    memcpy(batch->data, data, length);
+    batch->length = length;
+    batch->retried = false;
+    worker->outbox_length += length;
+    worker->outbox_count++;
+    backends[i].outbox_count = worker->outbox_count;
+    backends[i].outbox_length = worker->outbox_length;
+    return true;
+}
+
+// timestamps in the payload or the signature cannot wait for the rows to be resolved once sent
+static bool uploads_needs_time(uint8_t i)
+{
+    return !NOW && (backends[i].auth == BACKEND_AUTH_POSTMAN || strstr(backends[i].template_row, "@t") ||
+                    strstr(backends[i].template_row, "@T") || strstr(backends[i].template_row, "@i"));
+}
+
+// encodes the ring into a new batch of the outbox, called with the uploads lock held
+static void uploads_queue_ring(uint8_t i)
+{
+    size_t payload_length = uploads_encode(i, false);      // resolves the rows captured before the clock was set
+    if(payload_length && !uploads_outbox_push(i, uploads_payload, payload_length)) {
+        backends[i].status = BACKEND_STATUS_ERROR;
+        backends[i].error = ESP_ERR_NO_MEM;
+        backends[i].message[0] = 0;
+    }
+}
+
+static void uploads_backoff(uint8_t i)
+{
+    uploads_worker_t *worker = &uploads_workers[i];
+    int64_t delay = UPLOADS_BACKOFF_MIN << MIN(worker->failures, 16);
+
+    delay = MIN(delay, UPLOADS_BACKOFF_MAX);
+    delay = delay / 2 + esp_random() % (delay / 2);     // jitter, so that nodes failing together do not retry together
+    worker->retry_time = esp_timer_get_time() + delay * 1000000LL;
+    worker->failures++;
+    ESP_LOGI(__func__, "backend %i backed off for %lli s", i, delay);
+}
+
+// a signed copy of a postman batch, the signature carries the time of sending so it is only added then
+static char *uploads_sign(uint8_t i, uploads_batch_t *batch, size_t *length)
+{
+    uploads_lock();
+    size_t size = batch->length + strlen(backends[i].user) + UPLOADS_SIGNATURE_LENGTH;
+    char *data = malloc(size);
+    if(data) {
+        memcpy(data, batch->data, batch->length);
+        if(!measurements_sign_postman(data, &size, batch->length, backends[i].user, backends[i].key)) {
+            free(data);
+            data = NULL;
+        }
+    }
+    uploads_unlock();
+    *length = size;
+    return data;
+}
+
+// returns true if the batch is done with, either delivered or rejected for good
+static bool uploads_http_post(uint8_t i, char *payload, size_t payload_length)
+{
+    uploads_worker_t *worker = &uploads_workers[i];
+
+    esp_err_t err = uploads_http_perform(i, HTTP_METHOD_POST, payload, payload_length);
+    if(err != ESP_OK) {
+        backends[i].status = BACKEND_STATUS_ERROR;
+        backends[i].error = err;
+        backends[i].message[0] = 0;
+        return false;
+    }
+
+    uploads_lock();
+    int status = worker->status;
+    backends[i].status = status < 300 ? BACKEND_STATUS_ONLINE : BACKEND_STATUS_ERROR;
+    backends[i].error = status + BACKEND_ERROR_HTTP_STATUS_BASE;
+    worker->response[worker->response_length] = 0;     // allocated by uploads_submit before any HTTP job
+    strlcpy(backends[i].message, worker->response, sizeof(backends[i].message));
+
+    size_t response_length = 0;
+    if(status >= 300)
+        ESP_LOGI(__func__, "HTTP Error %i: %s", status, worker->response);
+    else if(worker->response_length && backends[i].format == BACKEND_FORMAT_POSTMAN && backends[i].auth == BACKEND_AUTH_POSTMAN) {
+        hmac_sha256_key_t binary_key;
+        if(hmac_hex_decode(binary_key, sizeof(binary_key), backends[i].key, strlen(backends[i].key)) == sizeof(binary_key)) {
+            ESP_LOGI(__func__, "Handling HTTP Postman request");
+            response_length = sizeof(bp_type_t) * postman_handle_pack(&postman,
+                (bp_type_t *) worker->response,
+                worker->response_length / sizeof(bp_type_t),
+                UPLOADS_BUFFER_LENGTH / sizeof(bp_type_t),
+                NOW, backends[i].user, binary_key);
+            ESP_LOGI(__func__, "HTTP Postman response: buffer length %u", response_length);
+        }
+        else
+            ESP_LOGI(__func__, "HMAC key is not 64 bytes long");
+    }
+    uploads_unlock();
+
+    if(response_length) {
+        err = uploads_http_perform(i, HTTP_METHOD_POST, worker->response, response_length);
+        int response_status = err == ESP_OK ? worker->status : 0;
+        ESP_LOGI(__func__, "HTTP Postman response: err %i status %i", err, response_status);
+    }
+
+    // client errors will not go away by retrying, except for timeouts and rate limiting
+    return status < 500 && status != 408 && status != 429;
+}
+
+static void uploads_http_send(uint8_t i)
+{
+    uploads_worker_t *worker = &uploads_workers[i];
+    esp_err_t err;
+
+    uploads_lock();
+    if((worker->client || worker->tls) && worker->epoch != backends_epoch)   // the backend changed or WiFi reconnected
+        uploads_http_close(i);
+    bool waiting = worker->waiting;
+    bool backed_off = esp_timer_get_time() < worker->retry_time;
+    uploads_unlock();
+
+    // only until the first response of any backend, the clock is kept across deep sleep afterwards
+    if(waiting && !backed_off && !NOW) {
+        err = uploads_http_perform(i, HTTP_METHOD_HEAD, NULL, 0);
+        if(err != ESP_OK) {
+            backends[i].status = BACKEND_STATUS_ERROR;
+            backends[i].error = err;
+            backends[i].message[0] = 0;
+            if(application_time_left() / 1000 >= UPLOADS_TIME_LEFT_MIN)
+                uploads_backoff(i);
+            backed_off = true;
+        }
+    }
+
+    uploads_lock();
+    if(worker->waiting && NOW) {    // the rows are still in the ring, the main loop drops them before the next pass
+        uploads_clear_payload();    // encoded for other backends before the rows were resolved
+        uploads_queue_ring(i);
+        worker->waiting = false;
+    }
+    bool sign = backends[i].format == BACKEND_FORMAT_POSTMAN && backends[i].auth == BACKEND_AUTH_POSTMAN;
+    uploads_unlock();
+
+    if(backed_off) {
+        ESP_LOGI(__func__, "backend %i backed off, %u batches waiting", i, worker->outbox_count);
+        return;
+    }
+
+    while(true) {
+        if(application_time_left() / 1000 < UPLOADS_TIME_LEFT_MIN) {
+            ESP_LOGI(__func__, "backend %i deferred by the wake budget, %u batches waiting", i, worker->outbox_count);
+            break;
+        }
+        uploads_batch_t batch;
+        uploads_lock();
+        bool taken = uploads_outbox_take(i, &batch);
+        worker->discard = false;    // batches queued from now on are for the current settings
+        uploads_unlock();
+        if(!taken)
+            break;
+        if(batch.retried)
+            backends[i].retries++;
+        size_t length = batch.length;
+        char *data = sign ? uploads_sign(i, &batch, &length) : batch.data;
+        bool done = data && uploads_http_post(i, data, length);
+        if(sign)
+            free(data);
+        if(!done) {
+            batch.retried = true;
+            uploads_lock();
+            uploads_outbox_return(i, &batch);
+            uploads_unlock();
+            if(application_time_left() / 1000 >= UPLOADS_TIME_LEFT_MIN)     // not the server's fault otherwise
+                uploads_backoff(i);
+            break;
+        }
+        if(backends[i].status != BACKEND_STATUS_ONLINE)
+            backends[i].dropped++;
+        free(batch.data);
+        worker->failures = 0;
+        worker->retry_time = 0;
+    }
+}
+
+// opens the connection while the main loop is still measuring, so that only the upload is left afterwards
+static void uploads_connect(uint8_t i)
+{
+    uploads_worker_t *worker = &uploads_workers[i];
+    int64_t limit = esp_timer_get_time() + UPLOADS_TIMEOUT * 1000LL;
+
+    while(wifi.status != WIFI_STATUS_ONLINE) {
+        if(esp_timer_get_time() > limit || application_time_left() / 1000 < UPLOADS_TIME_LEFT_MIN)
+            return;
+        vTaskDelay(20 / portTICK_PERIOD_MS);
+    }
+
+    if(backends[i].uri[0] == 'm') {     // MQTT clients connect in their own task once started
+        uploads_lock();
+        backends_start();
+        uploads_unlock();
+        return;
+    }
+
+    uploads_lock();
+    if((worker->client || worker->tls) && worker->epoch != backends_epoch)
+        uploads_http_close(i);
+    bool connected = worker->client || worker->tls;
+    uploads_unlock();
+    if(connected || esp_timer_get_time() < worker->retry_time)
+        return;
+
+    uploads_http_perform(i, HTTP_METHOD_HEAD, NULL, 0);     // its Date header sets the clock if still unset
+}
+
+static void uploads_task(void *arguments)
+{
+    uint8_t i = (uintptr_t) arguments;
+    uploads_job_t job;
+
+    while(true) {
+        if(xQueueReceive(uploads_workers[i].queue, &job, portMAX_DELAY) != pdTRUE)
+            continue;
+
+        ESP_LOGI(__func__, "started job %i for backend %i @ %lli", job, i, esp_timer_get_time());
+        switch(job) {
+            case UPLOADS_JOB_CONNECT:
+                uploads_connect(i);
+                uploads_workers[i].connecting = false;
+                break;
+            case UPLOADS_JOB_SEND:
+                uploads_http_send(i);
+                uploads_workers[i].sending = false;
+                break;
+        }
+        ESP_LOGI(__func__, "finished job %i for backend %i @ %lli", job, i, esp_timer_get_time());
+    }
+}
+
+// A send job encodes the ring into the outbox right away, so a worker still busy with the previous
+// one sends it afterwards. Returns false if the same job is still pending or the worker could not be created.
+bool uploads_submit(uint8_t backend, uploads_job_t job, bool modified)
+{
+    uploads_worker_t *worker = &uploads_workers[backend];
+    volatile bool *pending = job == UPLOADS_JOB_CONNECT ? &worker->connecting : &worker->sending;
+
+    // on every HTTP job, the worker may have been created for the backend when it was MQTT
+    if(backends[backend].uri[0] == 'h' && !worker->response && !(worker->response = malloc(UPLOADS_BUFFER_LENGTH))) {
+        ESP_LOGE(__func__, "unable to allocate the response buffer of backend %i", backend);
+        return false;
+    }
+    if(job == UPLOADS_JOB_SEND) {
+        uploads_lock();
+        if(modified) {      // the backend settings were replaced, pending batches may not fit anymore
+            while(worker->outbox_count)
+                uploads_outbox_pop(backend);
+            worker->failures = 0;
+            worker->retry_time = 0;
+            worker->discard = true;     // the one being sent, if any
+            worker->waiting = false;
+        }
+        if(uploads_needs_time(backend))
+            worker->waiting = true;     // the worker sets the clock first, then encodes the ring
+        else
+            uploads_queue_ring(backend);
+        uploads_unlock();
+    }
+    if(*pending)
+        return false;
+
+    if(!worker->task) {     // workers are only created for the backends that need them
+        worker->queue = worker->queue ? worker->queue : xQueueCreate(UPLOADS_QUEUE_LENGTH, sizeof(uploads_job_t));
+        if(!worker->queue ||
+           xTaskCreate(uploads_task, "uploads", UPLOADS_TASK_STACK_SIZE, (void *)(uintptr_t) backend, UPLOADS_TASK_PRIORITY, &worker->task) != pdPASS) {
+            ESP_LOGE(__func__, "unable to create the worker for backend %i", backend);
+            worker->task = NULL;
+            return false;
+        }
+    }
+
+    *pending = true;
+    if(xQueueSend(worker->queue, &job, 0) != pdTRUE) {
+        *pending = false;
+        return false;
+    }
+    return true;
+}
+
+// the rows of the ring are about to be dropped, the ones still waiting for the clock are lost
+void uploads_drop_waiting()
+{
+    for(int i = 0; i != BACKENDS_NUM_MAX; i++)
+        if(uploads_workers[i].waiting) {
+            uploads_workers[i].waiting = false;
+            backends[i].dropped++;
+            ESP_LOGE(__func__, "rows for backend %i dropped without a clock", i);
+        }
+}
+
+bool uploads_busy()
+{
+    for(int i = 0; i != BACKENDS_NUM_MAX; i++)
+        if(uploads_workers[i].connecting || uploads_workers[i].sending)
+            return true;
+    return false;
+}
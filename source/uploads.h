@@ -0,0 +1,93 @@
+// Copyright (c) 2024 José Francisco Castro <me@fran.cc>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef uploads_h
+#define uploads_h
+
+#define UPLOADS_BUFFER_LENGTH		(9 * 1024)		// same as POSTMAN_PACKET_LENGTH_MAX, to fit a postman request
+#define UPLOADS_TASK_STACK_SIZE		8192			// TLS handshakes run in the worker task
+#define UPLOADS_TASK_PRIORITY		5
+#define UPLOADS_QUEUE_LENGTH		2				// a connect and a send
+#define UPLOADS_OUTBOX_NUM_MAX		16				// batches waiting for a backend
+#define UPLOADS_OUTBOX_LENGTH_MAX	(16 * 1024)		// bytes waiting for a backend
+#define UPLOADS_BACKOFF_MIN			10				// seconds
+#define UPLOADS_BACKOFF_MAX			900
+#define UPLOADS_TIMEOUT				7000			// milliseconds, lowered to fit the wake budget
+#define UPLOADS_TIME_LEFT_MIN		500				// milliseconds, requests are deferred below this
+#define UPLOADS_DIGEST_REALM_LENGTH		64
+#define UPLOADS_DIGEST_NONCE_LENGTH		128
+#define UPLOADS_DIGEST_OPAQUE_LENGTH	128
+#define UPLOADS_CHALLENGE_LENGTH		384
+#define UPLOADS_SIGNATURE_LENGTH		64				// postman signature besides the id, added when a batch is sent
+#define UPLOADS_HEADERS_LENGTH			1024			// of a response read through esp_tls
+#define UPLOADS_TLS_SESSION_LENGTH		384				// serialized session with its ticket, kept in RTC memory
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/task.h>
+#include <esp_http_client.h>
+#include <esp_tls.h>
+
+#include "measurements.h"
+#include "pbuf.h"
+
+typedef enum {
+	UPLOADS_JOB_SEND = 0,
+	UPLOADS_JOB_CONNECT,
+} uploads_job_t;
+
+typedef struct {		// last digest challenge of a backend, kept in NVS so that wakes skip the 401 round trip
+	char realm[UPLOADS_DIGEST_REALM_LENGTH];
+	char nonce[UPLOADS_DIGEST_NONCE_LENGTH];
+	char opaque[UPLOADS_DIGEST_OPAQUE_LENGTH];
+	bool qop;							// qop=auth, with nc and cnonce
+	bool sha256;						// algorithm=SHA-256, MD5 otherwise
+} uploads_digest_t;
+
+typedef struct {
+	char *data;
+	size_t length;
+	bool retried;
+} uploads_batch_t;
+
+typedef struct {
+	TaskHandle_t task;
+	QueueHandle_t queue;
+	esp_http_client_handle_t client;	// kept open between jobs so that the connection is reused
+	esp_tls_t *tls;						// instead of the client if the backend resumes TLS sessions
+	uint32_t epoch;						// backends_epoch when the client or the connection was created
+	int status;							// of the last HTTP response
+	char *response;
+	size_t response_length;
+	char challenge[UPLOADS_CHALLENGE_LENGTH];	// from the WWW-Authenticate Digest header of the last response
+	uploads_digest_t digest;
+	uploads_batch_t outbox[UPLOADS_OUTBOX_NUM_MAX];
+	uint8_t outbox_first;
+	uint8_t outbox_count;
+	size_t outbox_length;
+	uint8_t failures;					// consecutive, for the exponential backoff
+	int64_t retry_time;					// no connection attempts before this esp_timer time
+	volatile bool discard;				// the batch being sent was encoded with replaced settings
+	volatile bool waiting;				// the rows of the ring wait for the clock to be encoded
+	volatile bool connecting;
+	volatile bool sending;
+} uploads_worker_t;
+
+extern char uploads_payload[];
+
+void uploads_init();
+void uploads_lock();
+void uploads_unlock();
+void uploads_clear_payload();
+size_t uploads_encode(uint8_t backend, bool sign);
+measurements_index_t uploads_encode_row(uint8_t backend, int n, int count, pbuf_t *buf);
+bool uploads_submit(uint8_t backend, uploads_job_t job, bool modified);
+void uploads_drop_waiting();
+bool uploads_busy();
+
+#endif
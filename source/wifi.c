@@ -19,6 +19,7 @@
 #include "wifi.h"
 
 wifi_t wifi;
+RTC_DATA_ATTR wifi_cache_t wifi_cache = { .valid = false };
 
 void wifi_init()
 {
@@ -31,7 +32,12 @@ void wifi_init()
 	wifi.ssid[0] = 0;
 	wifi.password[0] = 0;
     wifi.diagnostics = false;
+    wifi.reuse_ip = false;
     wifi.mac = 0;
+    wifi.cached = false;
+    wifi.cached_ip = false;
+    wifi.connect_time = 0;
+    wifi.online_time = -1;
 
     err = err ? err : (wifi_read_from_nvs() ? ESP_OK : ESP_FAIL);
     err = err ? err : esp_netif_init();
@@ -48,7 +54,7 @@ void wifi_init()
         if((wifi.mac & 0xFFFF) == 0)
             wifi.mac = (wifi.mac & 0xFFFFFF0000000000) | 0x000000FFFF000000 | ((wifi.mac & 0x000000FFFFFF0000) >> 16);
     }
-    if(wifi.ssid[0]) {
+    if(wifi.ssid[0] && application.upload) {     // the radio stays off on wakes without upload
         err = err ? err : esp_wifi_start();
         err = err ? err : (wifi_connect() ? ESP_OK : ESP_FAIL);
     }
@@ -72,18 +78,38 @@ void wifi_stop()
     esp_wifi_stop();
 }
 
+static esp_err_t wifi_configure()
+{
+    esp_err_t err = ESP_OK;
+    wifi_config_t wifi_config = {};
+    wifi_config.sta.threshold.authmode = WIFI_AUTH_WEP;
+    strncpy((char *) wifi_config.sta.ssid, wifi.ssid, sizeof(wifi_config.sta.ssid));
+    strncpy((char *) wifi_config.sta.password, wifi.password, sizeof(wifi_config.sta.password));
+
+    // The driver keeps the PMK in flash next to the config, so only the scan and DHCP are left to skip
+    wifi.cached = wifi_cache.valid;
+    if(wifi.cached) {
+        wifi_config.sta.bssid_set = true;
+        memcpy(wifi_config.sta.bssid, wifi_cache.bssid, sizeof(wifi_config.sta.bssid));
+        wifi_config.sta.channel = wifi_cache.channel;
+    }
+    wifi.cached_ip = wifi.cached && wifi.reuse_ip && wifi_cache.lease_time && NOW &&
+                     NOW - wifi_cache.lease_time < WIFI_CACHE_IP_REUSE_TIME;
+    if(!wifi.cached_ip)
+        esp_netif_dhcpc_start(wifi.netif);
+
+    err = err ? err : esp_wifi_set_config(WIFI_IF_STA, &wifi_config);
+    return err;
+}
+
 bool wifi_connect()
 {
     esp_err_t err = ESP_OK;
 
 	if(wifi.ssid[0]) {
-	    wifi_config_t wifi_config = {};
-	    wifi_config.sta.threshold.authmode = WIFI_AUTH_WEP;
-	    strncpy((char *) wifi_config.sta.ssid, wifi.ssid, sizeof(wifi_config.sta.ssid));
-	    strncpy((char *) wifi_config.sta.password, wifi.password, sizeof(wifi_config.sta.password));
-
+	    wifi.connect_time = esp_timer_get_time();
 	    err = err ? err : esp_wifi_disconnect();
-	    err = err ? err : esp_wifi_set_config(WIFI_IF_STA, &wifi_config);
+	    err = err ? err : wifi_configure();
 	    err = err ? err : esp_wifi_connect();
 
         if(err != ESP_OK) {
@@ -109,11 +135,29 @@ void wifi_event_handler(void* args, esp_event_base_t base, int32_t id, void* eve
             ESP_LOGI(__func__, "wifi connected @ %lli", esp_timer_get_time());
             // esp_netif_create_ip6_linklocal((esp_netif_t *)args);
             wifi.status = WIFI_STATUS_CONNECTED;
+            if(wifi.cached_ip) {    // as a static address, which the interface only takes once associated
+                esp_netif_dns_info_t dns = { .ip.type = ESP_IPADDR_TYPE_V4, .ip.u_addr.ip4 = wifi_cache.dns };
+                esp_netif_dhcpc_stop(wifi.netif);
+                if(esp_netif_set_ip_info(wifi.netif, &wifi_cache.ip_info) != ESP_OK ||
+                   esp_netif_set_dns_info(wifi.netif, ESP_NETIF_DNS_MAIN, &dns) != ESP_OK) {
+                    ESP_LOGI(__func__, "cached lease failed, asking for a new one");
+                    wifi.cached_ip = false;
+                    esp_netif_dhcpc_start(wifi.netif);
+                }
+            }
             break;
         case WIFI_EVENT_STA_DISCONNECTED:
             ESP_LOGI(__func__, "wifi disconnected");
             wifi.status = WIFI_STATUS_DISCONNECTED;
             wifi.disconnected = true;
+            // The cached access point may have moved or gone, so scan all channels and ask for a lease
+            if(wifi.cached) {
+                ESP_LOGI(__func__, "cached access point failed, scanning");
+                wifi_cache.valid = false;
+                if(wifi_configure() == ESP_OK)
+                    esp_wifi_connect();
+                break;
+            }
             // This is a workaround as ESP32 WiFi libs don't currently auto-reassociate.
             if(wifi.ssid[0] && wifi.password[0]) {
                 vTaskDelay (2000 / portTICK_PERIOD_MS);
@@ -131,6 +175,22 @@ void wifi_event_handler(void* args, esp_event_base_t base, int32_t id, void* eve
             ESP_LOGI(__func__, "got ip " IPSTR " @ %lli", IP2STR(&event->ip_info.ip), esp_timer_get_time());
             wifi.status = WIFI_STATUS_ONLINE;
             wifi.reconnected = true;
+            wifi.online_time = esp_timer_get_time() - wifi.connect_time;
+            wifi.cached = false;
+            wifi_ap_record_t ap;
+            esp_netif_dns_info_t dns;
+            esp_netif_dhcp_status_t dhcp = ESP_NETIF_DHCP_STOPPED;
+            esp_netif_dhcpc_get_status(wifi.netif, &dhcp);
+            if(dhcp == ESP_NETIF_DHCP_STARTED) {    // a reused address keeps the time of its lease
+                wifi_cache.ip_info = event->ip_info;
+                wifi_cache.dns.addr = esp_netif_get_dns_info(wifi.netif, ESP_NETIF_DNS_MAIN, &dns) == ESP_OK ? dns.ip.u_addr.ip4.addr : event->ip_info.gw.addr;
+                wifi_cache.lease_time = NOW;
+            }
+            if(esp_wifi_sta_get_ap_info(&ap) == ESP_OK) {
+                memcpy(wifi_cache.bssid, ap.bssid, sizeof(wifi_cache.bssid));
+                wifi_cache.channel = ap.primary;
+                wifi_cache.valid = true;
+            }
             break;
         case IP_EVENT_GOT_IP6:
             ip_event_got_ip6_t *evt = (ip_event_got_ip6_t *)event_data;
@@ -158,6 +218,7 @@ bool wifi_read_from_nvs()
         if(nvs_get_str(handle, "password", wifi.password, &size) != ESP_OK)
             wifi.password[0] = 0;
         nvs_get_u8(handle, "diagnostics", (uint8_t *) &(wifi.diagnostics));
+        nvs_get_u8(handle, "reuse_ip", (uint8_t *) &(wifi.reuse_ip));
         nvs_close(handle);
         ESP_LOGI(__func__, "done");
         return true;
@@ -179,6 +240,7 @@ bool wifi_write_to_nvs()
 		ok = ok && !nvs_set_str(handle, "ssid", wifi.ssid);
 		ok = ok && !nvs_set_str(handle, "password", wifi.password);
         ok = ok && !nvs_set_u8(handle, "diagnostics", wifi.diagnostics);
+        ok = ok && !nvs_set_u8(handle, "reuse_ip", wifi.reuse_ip);
         ok = ok && !nvs_commit(handle);
         nvs_close(handle);
         ESP_LOGI(__func__, "%s", ok ? "done" : "failed");
@@ -229,6 +291,11 @@ static bool write_resource_schema(bp_pack_t *writer)
                 ok = ok && bp_put_integer(writer, SCHEMA_BOOLEAN);
             ok = ok && bp_finish_container(writer);
 
+            ok = ok && bp_put_string(writer, "reuse_ip");
+            ok = ok && bp_create_container(writer, BP_LIST);
+                ok = ok && bp_put_integer(writer, SCHEMA_BOOLEAN);
+            ok = ok && bp_finish_container(writer);
+
             ok = ok && bp_put_string(writer, "rssi");
             ok = ok && bp_create_container(writer, BP_LIST);
                 ok = ok && bp_put_integer(writer, SCHEMA_INTEGER);
@@ -279,6 +346,8 @@ uint32_t wifi_resource_handler(uint32_t method, bp_pack_t *reader, bp_pack_t *wr
         ok = ok && bp_put_string(writer, wifi.password);
         ok = ok && bp_put_string(writer, "diagnostics");
         ok = ok && bp_put_boolean(writer, wifi.diagnostics);
+        ok = ok && bp_put_string(writer, "reuse_ip");
+        ok = ok && bp_put_boolean(writer, wifi.reuse_ip);
         ok = ok && bp_put_string(writer, "rssi");
         ok = ok && bp_put_integer(writer, rssi);
         ok = ok && bp_finish_container(writer);
@@ -295,10 +364,13 @@ uint32_t wifi_resource_handler(uint32_t method, bp_pack_t *reader, bp_pack_t *wr
                     ok = ok && bp_get_string(reader, wifi.password, sizeof(wifi.password) / sizeof(bp_type_t)) != BP_INVALID_LENGTH;
                 else if(bp_match(reader, "diagnostics"))
                     wifi.diagnostics = bp_get_boolean(reader);
+                else if(bp_match(reader, "reuse_ip"))
+                    wifi.reuse_ip = bp_get_boolean(reader);
                 else bp_next(reader);
             }
             bp_close(reader);
             ok = ok && wifi_write_to_nvs();
+            wifi_cache.valid = false;
             wifi_stop();
             if(wifi.ssid[0])
                 wifi_start();
@@ -314,6 +386,12 @@ uint32_t wifi_resource_handler(uint32_t method, bp_pack_t *reader, bp_pack_t *wr
 void wifi_measure()
 {
     int rssi;
+
+    now_snapshot();     // appended after the measurement pass, when the connection is up
     if(wifi.diagnostics && wifi.status >= WIFI_STATUS_CONNECTED && esp_wifi_sta_get_rssi(&rssi) == ESP_OK)
-        measurements_append(board.id, RESOURCE_WIFI, 0, 0, 0, 0, 0, 0, METRIC_RSSI, NOW, UNIT_dBm, rssi);
+        measurements_append(board.id, RESOURCE_WIFI, 0, 0, 0, 0, 0, 0, METRIC_RSSI, NOW_MS, UNIT_dBm, rssi);
+    if(wifi.diagnostics && wifi.online_time >= 0) {
+        measurements_append(board.id, RESOURCE_WIFI, 0, 0, 0, 0, 0, 0, METRIC_ConnectTime, NOW_MS, UNIT_s, wifi.online_time / 1000000.0);
+        wifi.online_time = -1;
+    }
 }
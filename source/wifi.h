@@ -7,6 +7,7 @@
 #include <stdalign.h>
 
 #include <esp_system.h>
+#include <esp_netif.h>
 #include <esp_wifi.h>
 #include <freertos/event_groups.h>
 
@@ -14,6 +15,16 @@
 
 #define WIFI_SSID_LENGTH		33
 #define WIFI_PASSWORD_LENGTH	64
+#define WIFI_CACHE_IP_REUSE_TIME	1800	// seconds a DHCP lease is reused without asking the server again, well within usual leases
+
+typedef struct {
+	uint8_t bssid[6];
+	uint8_t channel;
+	bool valid;
+	uint32_t lease_time;				// wall-clock seconds when the lease was obtained, 0 if the clock was not set
+	esp_netif_ip_info_t ip_info;
+	esp_ip4_addr_t dns;
+} wifi_cache_t;
 
 typedef struct {
 	char ssid[WIFI_SSID_LENGTH];
@@ -21,13 +32,19 @@ typedef struct {
 	uint64_t mac;
 	uint8_t status;
 	bool diagnostics;
+	bool reuse_ip;
 
     esp_netif_t *netif;
 	bool reconnected;
 	bool disconnected;
+	bool cached;						// connecting to the cached access point
+	bool cached_ip;						// the cached lease is applied once associated
+	int64_t connect_time;				// esp_timer time of the last connection attempt
+	int64_t online_time;				// from connection attempt to IP address, reported once
 } wifi_t;
 
 extern wifi_t wifi;
+extern wifi_cache_t wifi_cache;
 
 void wifi_init();
 void wifi_start();
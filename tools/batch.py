@@ -0,0 +1,113 @@
+#!/usr/bin/env python3
+#
+#  Batch decoder - Copyright (c) 2024 Francisco Castro <http://fran.cc>
+#
+#  Permission is hereby granted, free of charge, to any person obtaining a
+#  copy of this software and associated documentation files (the "Software"),
+#  to deal in the Software without restriction, including without limitation
+#  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+#  and/or sell copies of the Software, and to permit persons to whom the
+#  Software is furnished to do so, subject to the following conditions:
+#
+#  The above copyright notice and this permission notice shall be included in
+#  all copies or substantial portions of the Software.
+#
+#  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+#  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+#  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+#  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+#  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+#  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+#  DEALINGS IN THE SOFTWARE.
+
+# Reference decoder for the "batch" backend format. Each UDP datagram starts
+# with a header (magic, session, sequence, base timestamp) followed by records
+# keyed by a varint (id << 1 | definition). Definitions bind an id to a
+# (node, descriptor, address) series for the rest of the session, samples
+# carry a zigzag varint timestamp delta in milliseconds and a float value.
+# The base timestamp is in whole seconds. A new session
+# means the sensor rebooted or ran out of ids, so its dictionary is dropped.
+# Samples whose id is still unknown after a lost datagram are skipped until
+# the periodic resync announces them again.
+
+import sys
+import struct
+import socket
+
+BATCH_MAGIC = 0xBB
+
+class BatchDecoder:
+    def __init__(self):
+        self.session = None
+        self.sequence = None
+        self.series = {}
+        self.lost = 0
+        self.skipped = 0
+
+    def varint(self, data, offset):
+        value = shift = 0
+        while True:
+            byte = data[offset]
+            offset += 1
+            value |= (byte & 0x7F) << shift
+            shift += 7
+            if not byte & 0x80:
+                return value, offset
+
+    def decode(self, data):
+        magic, session, sequence, base = struct.unpack_from("<BIHI", data, 0)
+        if magic != BATCH_MAGIC:
+            raise ValueError("not a batch datagram")
+        if session != self.session:
+            self.session, self.series = session, {}
+        elif sequence != (self.sequence + 1) & 0xFFFF:
+            self.lost += (sequence - self.sequence - 1) & 0xFFFF
+        self.sequence = sequence
+
+        timestamp = base * 1000
+        measurements = []
+        offset = struct.calcsize("<BIHI")
+        while offset < len(data):
+            key, offset = self.varint(data, offset)
+            if key & 1:
+                self.series[key >> 1] = struct.unpack_from("<QQQ", data, offset)
+                offset += 24
+                continue
+            delta, offset = self.varint(data, offset)
+            timestamp += (delta >> 1) ^ -(delta & 1)
+            value, = struct.unpack_from("<f", data, offset)
+            offset += 4
+            if key >> 1 not in self.series:
+                self.skipped += 1
+                continue
+            node, descriptor, address = self.series[key >> 1]
+            measurements.append({ "node": node, "address": address, "timestamp": timestamp / 1000, "value": value,
+                                  **self.unpack_descriptor(descriptor) })
+        return measurements
+
+    @staticmethod
+    def unpack_descriptor(descriptor):
+        return { "resource":    (descriptor >> 8) & 0x3F,
+                 "bus":         (descriptor >> 14) & 0x07,
+                 "multiplexer": (descriptor >> 17) & 0x07,
+                 "channel":     (descriptor >> 20) & 0x0F,
+                 "part":        (descriptor >> 24) & 0x0FFF,
+                 "parameter":   (descriptor >> 36) & 0xFF,
+                 "metric":      (descriptor >> 44) & 0x0FFF,
+                 "unit":        (descriptor >> 56) & 0xFF }
+
+if __name__ == "__main__":
+    if len(sys.argv) != 2:
+        print("\nUsage: %s <UDP port>\n" % sys.argv[0])
+        sys.exit(1)
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind(("", int(sys.argv[1])))
+    decoders = {}
+    while True:
+        data, sender = sock.recvfrom(2048)
+        decoder = decoders.setdefault(sender[0], BatchDecoder())
+        for measurement in decoder.decode(data):
+            print(sender[0], measurement)
+        if decoder.lost or decoder.skipped:
+            print(sender[0], "lost datagrams: %i, skipped measurements: %i" % (decoder.lost, decoder.skipped))
@@ -0,0 +1,6 @@
+// Copyright (c) 2024 José Francisco Castro <me@fran.cc>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Host stand-in for the ESP-IDF header, for the harnesses in tools
+
+#define RTC_DATA_ATTR
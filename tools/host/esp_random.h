@@ -0,0 +1,8 @@
+// Copyright (c) 2024 José Francisco Castro <me@fran.cc>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Host stand-in for the ESP-IDF header, for the harnesses in tools
+
+#include <stdint.h>
+
+uint32_t esp_random(void);
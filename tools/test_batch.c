@@ -0,0 +1,79 @@
+// Copyright (c) 2024 José Francisco Castro <me@fran.cc>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Host harness for measurements_to_batch, built and driven by test_batch.py. Reads one command per line:
+//
+//   row <node> <address> <timestamp> <resource> <bus> <part> <parameter> <metric> <unit> <value> <aggregate>
+//       appends a row to the ring, node and address in hex, timestamp in milliseconds, value as a C float
+//   sequence <n>
+//       sets the sequence number of the next datagram
+//   send
+//       encodes the ring as the upload of a batch backend does, prints each datagram in hex on its own
+//       line and empties the ring
+
+#include <stdio.h>
+#include <string.h>
+
+#include "application.h"
+#include "backends.h"
+#include "measurements.h"
+
+extern measurements_dictionary_t measurements_dictionary;
+
+backend_t backends[BACKENDS_NUM_MAX];
+application_t application;
+
+uint32_t esp_random()
+{
+    static uint32_t state = 0x5EC0FFEE;
+    return state += 0x9E3779B9;
+}
+
+static void send()
+{
+    char data[2048];
+    int count = measurements_full ? MEASUREMENTS_NUM_MAX : measurements_count;
+
+    for(int n = 0; n < count; n++) {
+        pbuf_t buf = { data, sizeof(data), 0 };
+        int length = measurements_to_batch(n, count, 0, &buf);
+        if(!length) {
+            length = 1;
+            buf.length = 0;
+        }
+        for(size_t k = 0; k < buf.length; k++)
+            printf("%02x", (unsigned char) data[k]);
+        if(buf.length)
+            printf("\n");
+        n += length - 1;
+    }
+    measurements_init();
+}
+
+int main()
+{
+    char line[256];
+    unsigned long long node, address;
+    long long timestamp;
+    unsigned resource, bus, part, parameter, metric, unit, aggregate, sequence;
+    float value;
+
+    measurements_init();
+    while(fgets(line, sizeof(line), stdin)) {
+        if(sscanf(line, "row %llx %llx %lld %u %u %u %u %u %u %f %u", &node, &address, &timestamp, &resource, &bus, &part,
+                  &parameter, &metric, &unit, &value, &aggregate) == 11) {
+            measurement_t row = { .node = node, .address = address, .timestamp = timestamp, .value = value, .part = part,
+                                  .metric = metric, .resource = resource, .bus = bus, .parameter = parameter,
+                                  .unit = unit, .aggregate = aggregate };
+            if(!measurements_append_row(&row))
+                return 1;
+        }
+        else if(sscanf(line, "sequence %u", &sequence) == 1)
+            measurements_dictionary.sequence[0] = sequence;
+        else if(!strncmp(line, "send", 4))
+            send();
+        else
+            return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,134 @@
+#!/usr/bin/env python3
+#
+#  Batch decoder test - Copyright (c) 2024 Francisco Castro <http://fran.cc>
+#
+#  Permission is hereby granted, free of charge, to any person obtaining a
+#  copy of this software and associated documentation files (the "Software"),
+#  to deal in the Software without restriction, including without limitation
+#  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+#  and/or sell copies of the Software, and to permit persons to whom the
+#  Software is furnished to do so, subject to the following conditions:
+#
+#  The above copyright notice and this permission notice shall be included in
+#  all copies or substantial portions of the Software.
+#
+#  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+#  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+#  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+#  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+#  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+#  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+#  DEALINGS IN THE SOFTWARE.
+
+# Round trip of measurements_to_batch and the reference decoder. The encoder
+# of source/measurements.c is built for the host with test_batch.c, fed with
+# known rows, and its datagrams are decoded back into the same rows. The
+# harness needs gcc and GNU ld, as the parts of the firmware it does not run
+# are left unresolved.
+#
+#   python3 tools/test_batch.py
+
+import os
+import shutil
+import subprocess
+import tempfile
+import unittest
+
+from batch import BatchDecoder
+
+TOOLS = os.path.dirname(os.path.abspath(__file__))
+SOURCE = os.path.join(TOOLS, "..", "source")
+
+NODE = 0x0123456789ABCDEF
+TEMPERATURE = { "resource": 3, "bus": 1, "multiplexer": 0, "channel": 0, "part": 2, "parameter": 1, "metric": 4, "unit": 1 }
+HUMIDITY    = { "resource": 3, "bus": 1, "multiplexer": 0, "channel": 0, "part": 3, "parameter": 1, "metric": 5, "unit": 2 }
+PRESSURE    = { "resource": 3, "bus": 1, "multiplexer": 0, "channel": 0, "part": 4, "parameter": 1, "metric": 6, "unit": 3 }
+
+def row(address, timestamp, value, descriptor):
+    return { "node": NODE, "address": address, "timestamp": timestamp, "value": value, **descriptor }
+
+def command(measurement, aggregate=0):
+    return "row %x %x %d %u %u %u %u %u %u %s %u" % (measurement["node"], measurement["address"],
+        round(measurement["timestamp"] * 1000), measurement["resource"], measurement["bus"], measurement["part"],
+        measurement["parameter"], measurement["metric"], measurement["unit"], measurement["value"].hex(), aggregate)
+
+PASSES = [
+    [ row(0x76, 1700000000.25, 21.5, TEMPERATURE),
+      row(0x77, 1700000000.25, 48.25, HUMIDITY),
+      row(0x76, 1700000001.75, 21.75, TEMPERATURE) ],
+    [ row(0x76, 1700000061.0, 22.0, TEMPERATURE),
+      row(0x78, 1700000061.5, 1013.0, PRESSURE) ],
+    [ row(0x78, 1700000121.0, 1012.5, PRESSURE),
+      row(0x76, 1700000120.9, 22.5, TEMPERATURE) ],
+    [ row(0x78, 1700000181.0, 1012.0, PRESSURE),
+      row(0x77, 1700000181.0, 50.0, HUMIDITY) ] ]
+
+@unittest.skipUnless(shutil.which("gcc"), "the harness needs gcc")
+class TestBatch(unittest.TestCase):
+    @classmethod
+    def setUpClass(cls):
+        cls.directory = tempfile.TemporaryDirectory()
+        cls.harness = os.path.join(cls.directory.name, "test_batch")
+        subprocess.run(["gcc", "-std=gnu17", "-w", "-no-pie", "-fno-pic", "-I", os.path.join(TOOLS, "host"), "-I", SOURCE,
+                        os.path.join(TOOLS, "test_batch.c"), os.path.join(SOURCE, "measurements.c"),
+                        os.path.join(SOURCE, "pbuf.c"), os.path.join(SOURCE, "enums.c"),
+                        "-Wl,--unresolved-symbols=ignore-all", "-o", cls.harness], check=True)
+
+    @classmethod
+    def tearDownClass(cls):
+        cls.directory.cleanup()
+
+    def setUp(self):
+        self.decoder = BatchDecoder()
+
+    def encode(self, commands):
+        result = subprocess.run([self.harness], input="\n".join(commands) + "\n", capture_output=True, text=True, check=True)
+        return [bytes.fromhex(line) for line in result.stdout.split()]
+
+    def encode_passes(self, passes):
+        return self.encode([line for rows in passes for line in [command(r) for r in rows] + ["send"]])
+
+    def test_in_order(self):
+        datagrams = self.encode_passes(PASSES)
+        self.assertEqual(len(datagrams), len(PASSES))
+        for datagram, rows in zip(datagrams, PASSES):
+            self.assertEqual(self.decoder.decode(datagram), rows)
+        self.assertEqual((self.decoder.lost, self.decoder.skipped), (0, 0))
+
+    def test_missing_definition_and_resync(self):
+        # datagram 1 is lost, so the pressure sample in datagram 2 refers to a definition the decoder never saw
+        # and is skipped until the resync of datagram 3 announces it again
+        commands = [line for rows in PASSES[:3] for line in [command(r) for r in rows] + ["send"]]
+        datagrams = self.encode(commands + ["sequence 16"] + [command(r) for r in PASSES[3]] + ["send"])
+        self.decoder.decode(datagrams[0])
+        self.assertEqual(self.decoder.decode(datagrams[2]), PASSES[2][1:])
+        self.assertEqual((self.decoder.lost, self.decoder.skipped), (1, 1))
+        self.assertEqual(self.decoder.decode(datagrams[3]), PASSES[3])
+        self.assertEqual((self.decoder.lost, self.decoder.skipped), (14, 1))
+
+    def test_new_session(self):
+        datagrams = self.encode_passes(PASSES[:3])
+        self.decoder.decode(datagrams[0])
+        datagram = bytearray(datagrams[2])
+        datagram[1] ^= 0xFF     # another session, as after a reboot, drops the dictionary
+        self.assertEqual(self.decoder.decode(bytes(datagram)), [])
+        self.assertEqual(self.decoder.skipped, 2)
+
+    def test_full_dictionary(self):
+        # 40 series, the last ids of the dictionary included, and a new session once it is full
+        rows = [row(0x100 + k, 1700000000.0 + k / 8, 0.5 * k, TEMPERATURE) for k in range(40)]
+        decoded = [r for datagram in self.encode_passes([rows]) for r in self.decoder.decode(datagram)]
+        self.assertEqual(decoded, rows)
+        self.assertEqual((self.decoder.lost, self.decoder.skipped), (0, 0))
+
+    def test_samples_only(self):
+        # aggregates are left out, and a ring without samples sends nothing, not even a header
+        samples = PASSES[0]
+        commands = [command(samples[0]), command(samples[1], aggregate=1), command(samples[1]), command(samples[2], aggregate=5),
+                    command(samples[2]), "send", command(samples[0], aggregate=2), "send"]
+        datagrams = self.encode(commands)
+        self.assertEqual(len(datagrams), 1)
+        self.assertEqual(self.decoder.decode(datagrams[0]), samples)
+
+if __name__ == "__main__":
+    unittest.main()